@@ -0,0 +1,88 @@
+// Copyright (c) 2022 Valtteri Koskivuori (vkoskiv). All rights reserved.
+
+// Microbenchmark: uuid lookups through the connected_users list walk vs. uuid_index.h
+// Build & run: make bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uuid/uuid.h>
+#include "../src/ilist.h"
+#include "../src/uuid_index.h"
+
+#ifndef UUID_STR_LEN
+#define UUID_STR_LEN 37
+#endif
+
+#define LOOKUPS 200000
+
+struct user {
+	char uuid[UUID_STR_LEN + 1];
+	struct ilist_node node;
+	char padding[200]; // Roughly the size of the real thing
+};
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct user *list_find(struct ilist *users, const char *uuid) {
+	struct ilist_node *node = NULL;
+	ilist_foreach(node, (*users)) {
+		struct user *user = ilist_entry(node, struct user, node);
+		if (strncmp(user->uuid, uuid, UUID_STR_LEN) == 0) return user;
+	}
+	return NULL;
+}
+
+static void bench(size_t user_count) {
+	struct ilist users = ILIST_INITIALIZER;
+	struct uuid_index index;
+	uuid_index_init(&index, UUID_STR_LEN);
+	char (*keys)[UUID_STR_LEN + 1] = calloc(user_count, sizeof(*keys));
+	for (size_t i = 0; i < user_count; ++i) {
+		struct user *uptr = calloc(1, sizeof(*uptr));
+		uuid_t uuid;
+		uuid_generate_random(uuid);
+		uuid_unparse_lower(uuid, uptr->uuid);
+		ilist_push_back(&users, &uptr->node);
+		uuid_index_put(&index, uptr->uuid, uptr);
+		memcpy(keys[i], uptr->uuid, sizeof(keys[i]));
+	}
+
+	// Same pseudo-random mix of keys for both
+	size_t found_list = 0, found_index = 0;
+	srand(1);
+	double start = now_sec();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		found_list += list_find(&users, keys[rand() % user_count]) != NULL;
+	}
+	double list_sec = now_sec() - start;
+	srand(1);
+	start = now_sec();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		found_index += uuid_index_find(&index, keys[rand() % user_count]) != NULL;
+	}
+	double index_sec = now_sec() - start;
+
+	printf("%6zu users: list %9.1f ns/lookup, index %6.1f ns/lookup (%zu/%zu found)\n",
+		user_count, list_sec * 1e9 / LOOKUPS, index_sec * 1e9 / LOOKUPS, found_list, found_index);
+
+	free(keys);
+	uuid_index_destroy(&index);
+	struct ilist_node *node = NULL, *tmp = NULL;
+	ilist_foreach_safe(node, tmp, users) {
+		free(ilist_entry(node, struct user, node));
+	}
+}
+
+int main(void) {
+	size_t counts[] = { 10, 100, 1000, 10000, 20000 };
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		bench(counts[i]);
+	}
+	return 0;
+}
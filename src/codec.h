@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+#if ENABLE_ZSTD
+#include <zstd.h>
+#endif
+#if ENABLE_LZ4
+#include <lz4.h>
+#endif
+
+// Canvas codecs
+// Clients list the ones they can decode at auth, and the canvas gets sent to
+// them with the first one we have. Ids go out on the wire, so don't renumber.
+// zstd and LZ4 are optional, build with ZSTD=1 / LZ4=1 to get them.
+// Packed codecs bit-pack palette indices before compressing, see RES_CANVAS_PACKED.
+
+enum codec_id {
+	CODEC_NONE = 0, // Stored as is, for displays on a fast link
+	CODEC_ZLIB,
+	CODEC_ZLIB_FAST,
+	CODEC_ZLIB_BEST,
+	CODEC_ZSTD,
+	CODEC_ZSTD_BEST,
+	CODEC_LZ4,
+	CODEC_PACKED,
+	CODEC_ZLIB_PACKED,
+	CODEC_COUNT
+};
+
+#define CODEC_DEFAULT CODEC_ZLIB
+
+struct codec {
+	const char *name; // NULL if not built in
+	int level;
+	size_t (*bound)(size_t src_len);
+	// Returns the compressed length, 0 on failure
+	size_t (*compress)(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len, int level);
+	bool packed; // Compresses bit-packed palette indices instead of color ids
+};
+
+static inline size_t _none_bound(size_t src_len) {
+	return src_len;
+}
+
+static inline size_t _none_compress(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len, int level) {
+	(void)level;
+	if (dst_len < src_len) return 0;
+	memcpy(dst, src, src_len);
+	return src_len;
+}
+
+static inline size_t _zlib_bound(size_t src_len) {
+	return compressBound(src_len);
+}
+
+static inline size_t _zlib_compress(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len, int level) {
+	uLongf len = dst_len;
+	if (compress2(dst, &len, src, src_len, level) != Z_OK) return 0;
+	return len;
+}
+
+#if ENABLE_ZSTD
+static inline size_t _zstd_bound(size_t src_len) {
+	return ZSTD_compressBound(src_len);
+}
+
+static inline size_t _zstd_compress(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len, int level) {
+	size_t len = ZSTD_compress(dst, dst_len, src, src_len, level);
+	return ZSTD_isError(len) ? 0 : len;
+}
+#endif
+
+#if ENABLE_LZ4
+static inline size_t _lz4_bound(size_t src_len) {
+	return LZ4_compressBound(src_len);
+}
+
+static inline size_t _lz4_compress(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len, int level) {
+	(void)level;
+	int len = LZ4_compress_default((const char *)src, (char *)dst, src_len, dst_len);
+	return len > 0 ? (size_t)len : 0;
+}
+#endif
+
+static const struct codec codecs[CODEC_COUNT] = {
+	[CODEC_NONE]      = { "none", 0, _none_bound, _none_compress },
+	[CODEC_ZLIB]      = { "zlib", Z_DEFAULT_COMPRESSION, _zlib_bound, _zlib_compress },
+	[CODEC_ZLIB_FAST] = { "zlib-fast", Z_BEST_SPEED, _zlib_bound, _zlib_compress },
+	[CODEC_ZLIB_BEST] = { "zlib-best", Z_BEST_COMPRESSION, _zlib_bound, _zlib_compress },
+#if ENABLE_ZSTD
+	[CODEC_ZSTD]      = { "zstd", 1, _zstd_bound, _zstd_compress },
+	[CODEC_ZSTD_BEST] = { "zstd-best", 19, _zstd_bound, _zstd_compress },
+#endif
+#if ENABLE_LZ4
+	[CODEC_LZ4]       = { "lz4", 0, _lz4_bound, _lz4_compress },
+#endif
+	[CODEC_PACKED]      = { "packed", 0, _none_bound, _none_compress, true },
+	[CODEC_ZLIB_PACKED] = { "zlib-packed", Z_DEFAULT_COMPRESSION, _zlib_bound, _zlib_compress, true },
+};
+
+// CODEC_COUNT if we don't have it
+static inline enum codec_id codec_by_name(const char *name) {
+	for (size_t i = 0; i < CODEC_COUNT; ++i) {
+		if (codecs[i].name && !strcmp(codecs[i].name, name)) return (enum codec_id)i;
+	}
+	return CODEC_COUNT;
+}
+
+// end codecs
@@ -0,0 +1,53 @@
+#include <stddef.h>
+#include <stdbool.h>
+
+// Intrusive doubly linked list
+// Embed a struct ilist_node in whatever goes in the list, and get back to it with ilist_entry().
+// Nothing is allocated or copied, and counting and removal are O(1).
+// A thing can be in several lists at once, with a node for each.
+
+struct ilist_node {
+	struct ilist_node *prev;
+	struct ilist_node *next;
+};
+
+struct ilist {
+	struct ilist_node *first;
+	struct ilist_node *last;
+	size_t count;
+};
+
+#define ILIST_INITIALIZER (struct ilist){ .first = NULL, .last = NULL, .count = 0 }
+
+#define ilist_entry(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+static inline void ilist_push_back(struct ilist *list, struct ilist_node *node) {
+	node->next = NULL;
+	node->prev = list->last;
+	if (list->last) list->last->next = node;
+	else list->first = node;
+	list->last = node;
+	list->count++;
+}
+
+static inline void ilist_remove(struct ilist *list, struct ilist_node *node) {
+	if (node->prev) node->prev->next = node->next;
+	else list->first = node->next;
+	if (node->next) node->next->prev = node->prev;
+	else list->last = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+	list->count--;
+}
+
+static inline bool ilist_empty(const struct ilist *list) {
+	return !list->count;
+}
+
+#define ilist_foreach(node, list) for (node = (list).first; node; node = node->next)
+
+// Lets the body remove node
+#define ilist_foreach_safe(node, tmp, list) \
+	for (node = (list).first; node && ((tmp = node->next), true); node = tmp)
+
+// end intrusive list
@@ -7,7 +7,11 @@
 
 #include "vendored/mongoose.h"
 #include "vendored/cJSON.h"
-#include "linked_list.h"
+#include "ilist.h"
+#include "pool.h"
+#include "timer_wheel.h"
+#include "uuid_index.h"
+#include "codec.h"
 #include "logging.h"
 #include "fileio.h"
 #include <uuid/uuid.h>
@@ -43,16 +47,30 @@ struct rate_limiter {
 	float *per_seconds;
 };
 
+// In chunks, not tiles
+struct chunk_rect {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
 struct user {
 	char user_name[MAX_NICK_LEN];
 	char uuid[UUID_STR_LEN + 1];
-	struct mg_connection *socket;
-	struct mg_timer *tile_increment_timer;
-	bool is_authenticated;
+	struct mg_connection *socket; // socket->fn_data points back here
+	struct ilist_node reactor_node; // In the sockets of the reactor that owns socket
+	// Fell behind and tile updates are being skipped.
+	// Gets a fresh canvas once its send queue drains.
+	bool needs_resync;
+	// On the wheel of the reactor that owns socket
+	struct wheel_timer ping_timer;
+	struct wheel_timer idle_timer;
 	bool is_shadow_banned;
 
 	struct rate_limiter canvas_limiter;
 	struct rate_limiter tile_limiter;
+	struct rate_limiter subscribe_limiter; // Not saved, every connection starts out with a full allowance
 	
 	uint32_t remaining_tiles;
 	uint32_t max_tiles;
@@ -63,12 +81,16 @@ struct user {
 	uint32_t level;
 	uint64_t last_connected_unix;
 	uint64_t last_event_unix;
-};
-
-struct tile {
-	uint8_t color_id;
-	uint64_t place_time_unix;
-	char last_modifier[UUID_STR_LEN];
+	uint64_t last_regen_unix; // Tiles regenerate lazily from here, see regen_tiles()
+	uint32_t unsent_tiles; // Regenerated, but the client hasn't been told yet
+	uint32_t modifier_id; // Interned uuid, 0 until the first tile placed, see intern_uuid()
+	enum codec_id codec; // For the canvas, see parse_codecs()
+	bool legacy_canvas; // Listed no codecs, so it gets RES_CANVAS instead of chunks
+	// Only gets tile updates for these chunks if subscribed, see handle_req_subscribe()
+	bool is_subscribed;
+	struct chunk_rect subscription;
+	uint32_t *subscription_slots; // Where it is in the subscribers of each chunk of subscription, row by row
+	struct mg_iobuf filtered_updates; // Gathered for it while delivering a batch
 };
 
 struct params {
@@ -77,12 +99,23 @@ struct params {
 	float getcanvas_per_seconds;
 	float setpixel_max_rate;
 	float setpixel_per_seconds;
+	float subscribe_max_rate;
+	float subscribe_per_seconds;
 	size_t max_users_per_ip;
 	size_t canvas_save_interval_sec;
 	size_t websocket_ping_interval_sec;
 	size_t users_save_interval_sec;
 	size_t kick_inactive_after_sec;
 	size_t max_concurrent_users;
+	size_t reactor_threads;
+	size_t tile_update_interval_ms;
+	bool ws_deflate;
+	bool ws_deflate_context_takeover;
+	size_t max_send_backlog_kb;
+	size_t max_cached_hosts;
+	size_t tile_update_history;
+	size_t canvas_cache_interval_ms;
+	size_t compress_threads;
 	char listen_url[128];
 	char dbase_file[PATH_MAX];
 };
@@ -92,12 +125,6 @@ struct color_list {
 	size_t amount;
 };
 
-struct tile_placement {
-	size_t x;
-	size_t y;
-	struct tile tile;
-};
-
 struct administrator {
 	char uuid[UUID_STR_LEN + 1];
 	bool can_shutdown;
@@ -107,35 +134,337 @@ struct administrator {
 	bool can_cleanup;
 };
 
-struct canvas {
+// Subscribers of one canvas chunk
+struct chunk_subscribers {
+	struct user **users;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+// A reactor is one event loop thread with its own mg_mgr and listener.
+// Connections accepted by a reactor, and the users on them, are only ever touched by that thread.
+// Anything another thread wants delivered to them goes through the mailbox.
+struct reactor {
 	struct mg_mgr mgr;
-	struct list connected_users;
-	size_t connected_user_count;
-	struct list connected_hosts;
-	struct list administrators;
-	struct list delta;
-	struct tile *tiles;
-	bool dirty;
+	struct canvas *canvas;
+	pthread_t thread;
+	size_t idx;
+	struct pool user_pool; // struct user
+	struct ilist sockets; // Users authenticated on connections owned by this reactor
+	size_t resyncs_pending;
+	struct timer_wheel wheel; // Per-user timers
+	pthread_mutex_t mailbox_lock;
+	struct mg_iobuf mailbox;
+	int wakeup_fd;
+	// Users here subscribed to part of the canvas, one list per level 0 chunk.
+	// Allocated when the first one subscribes.
+	struct chunk_subscribers *subscribers;
+	size_t subscribed_count;
+	struct user **touched; // Users with filtered updates to send, subscribed_count of them at most
+	uint32_t delivered_seq; // Where the next tile update batch this reactor gets starts, see resync_timer_fn()
+	struct region_reply *pending_region; // Taken by handle_req_get_region(), sent by send_pending_region() once that returns
+	// Tiles placed on this reactor since the last flush_tile_updates(), uint32_t tile indices in placement order.
+	// Whichever reactor flushes takes them, so it's guarded by pending_lock.
+	pthread_mutex_t pending_lock;
+	struct mg_iobuf pending_updates;
+	// Connections waiting on the db thread to authenticate them, unsigned long conn ids.
+	// Whatever they send in the meantime is held back until it's done, see hold_message().
+	struct mg_iobuf authing;
+	struct mg_iobuf held; // struct held_message headers, each followed by its data
+};
+
+struct tile_history_entry {
+	uint32_t i;
+	uint8_t color_id;
+};
+
+// Slow consumer events since they were last logged
+struct backpressure_stats {
+	size_t fell_behind;
+	size_t updates_skipped;
+	size_t resyncs;
+};
+
+struct remote_host {
+	struct mg_addr addr;
+	size_t total_accounts;
+	bool stored; // Has a row in the hosts table
+	bool dirty; // total_accounts changed since it was last written
+	struct remote_host *hash_next;
+	struct remote_host *lru_prev; // Towards most recently used
+	struct remote_host *lru_next;
+};
+
+// The canvas is compressed in CANVAS_CHUNK_EDGE sized squares, so a changed tile
+// only costs recompressing its own chunk. Chunks on the right and bottom edges
+// are cut short if the canvas isn't a multiple of it.
+#define CANVAS_CHUNK_EDGE 64
+
+// Dense indices for the color ids in the color list, for packed codecs.
+// Colors that aren't in the list anymore pack as index 0, clients can't draw them anyway.
+struct canvas_palette {
+	uint8_t bits; // Per index
+	uint16_t count;
+	uint8_t ids[256]; // By index, ascending
+	uint8_t index_of[256]; // By color id
+};
+
+struct chunk_blob {
+	struct mg_shared *data; // Colors row by row, compressed with the codec. Replaced, never changed.
+	uint32_t version; // Of the chunk when it was compressed
+};
+
+struct canvas_chunk {
+	uint32_t version; // Bumped whenever tiles in it change
+	struct chunk_blob blobs[CODEC_COUNT]; // Only the codecs clients have asked for
+};
+
+// Level 0 is the canvas, each one after it is the one before scaled down by 2, for zoomed out views.
+// A tile on those is the most common color of the 2x2 tiles below it, ties keep the color it had.
+#define CANVAS_LEVELS 4
+
+// A level of the canvas as of the last snapshot, split into chunks of CANVAS_CHUNK_EDGE tiles
+struct chunk_plane {
+	uint8_t *colors;
+	uint32_t edge_length;
+	uint32_t chunks_per_edge;
+	struct canvas_chunk *chunks; // Row by row
+};
+
+// RES_CANVAS_CHUNKS is the response id and the codec id as u8s, then the canvas edge length
+// and CANVAS_CHUNK_EDGE as u16s, then each chunk row by row as a u32 length and a blob.
+// RES_CANVAS_PACKED, for packed codecs, has the bits per index as a u8, the palette length
+// as a u16 and the color id of each index right after the header.
+// RES_CANVAS_REGION is the response id and the level as u8s, the x, y, width and height of the chunks
+// in it as u16s, then the chunks of that level in that rectangle laid out like either of the above,
+// with the edge length of the level.
+// Everything in network byte order.
+#define CANVAS_CHUNKS_HEADER_LEN 6
+#define CANVAS_REGION_HEADER_LEN 10
+
+// Clients that don't list any codecs get the whole canvas as one zlib stream after a RES_CANVAS byte,
+// like before chunks. Its cache goes after the ones for codecs.
+#define CANVAS_FORMAT_LEGACY CODEC_COUNT
+#define CANVAS_FORMAT_COUNT (CODEC_COUNT + 1)
+
+// Pre-framed RES_CANVAS_CHUNKS message for one codec, or RES_CANVAS for CANVAS_FORMAT_LEGACY.
+// Immutable, replaced wholesale when the canvas changes.
+struct canvas_cache {
+	struct mg_shared *frame;
+	size_t len; // Compressed bytes in it
+	float compression_ratio;
+	uint64_t generation; // canvas_generation it was built from
+	uint32_t seq; // Has every tile update numbered before this, see snapshot_dirty_chunks()
+};
+
+// The worker's own copy of a level, so it can compress without chunks_lock.
+// Chunks only get copied again once their version moves on.
+struct level_copy {
+	uint8_t *colors; // Laid out like the level
+	uint32_t *versions; // Of each chunk when it was copied
+};
+
+// A chunk for the compress pool, see refresh_chunks()
+struct compress_job {
+	uint32_t chunk;
+	uint32_t version; // Of the chunk in the worker's copy it gets compressed from
+	struct mg_shared *blob;
+};
+
+// A chunk of a region, either a ref to its blob if that was fresh, or a copy of its colors to compress
+struct region_chunk {
+	struct mg_shared *blob;
+	uint8_t *colors;
+	size_t count;
+};
+
+// What a RES_CANVAS_REGION needs from the snapshot, so it can be put together without locks
+struct region_reply {
+	uint8_t level;
+	enum codec_id codec;
+	struct chunk_rect rect;
+	uint32_t edge_length; // Of the level
+	struct canvas_palette palette;
+	struct region_chunk *chunks; // Row by row
+};
+
+// Threads that compress stale chunks for the worker alongside it, see compress_chunks()
+struct compress_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	pthread_t *threads;
+	size_t thread_count;
+	bool stop;
+	// The job being worked on
+	struct canvas *canvas;
+	size_t level;
+	enum codec_id codec;
+	struct compress_job *jobs; // One per canvas chunk at most
+	size_t count;
+	size_t next; // First one nobody has picked up yet
+	size_t done;
+};
+
+enum db_job_type {
+	DB_SAVE_USERS,
+	DB_AUTH, // Load the user for a connection
+	DB_INITIAL_AUTH, // Make a new one for it
+	DB_TILE_INFO,
+	DB_SET_NAME,
+	DB_SHADOW_BAN,
+	DB_SAVE_CANVAS,
+	DB_RESIZE_HOSTS,
+	DB_BACKUP,
+	DB_STOP,
+};
+
+// Work for the db thread. Replies go to the connection conn_id of reply_to, through its mailbox.
+struct db_job {
+	struct db_job *next;
+	enum db_job_type type;
+	struct reactor *reply_to;
+	unsigned long conn_id;
+	char uuid[UUID_STR_LEN + 1]; // Of the user it's about
+	union {
+		struct {
+			struct user *users; // Copies
+			size_t count;
+		} save;
+		struct {
+			bool legacy_canvas;
+			enum codec_id codec; // See parse_codecs()
+			bool has_addr; // DB_INITIAL_AUTH
+			struct mg_addr addr;
+		} auth;
+		uint64_t place_time; // DB_TILE_INFO
+		char name[MAX_NICK_LEN]; // DB_SET_NAME
+		struct {
+			bool toggle; // Or a ban click at x, y, which only bans
+			size_t x;
+			size_t y;
+		} ban;
+	};
+};
+
+// Does all the sqlite work once the reactors are up, so no reactor ever waits on the disk.
+// It owns backing_db and the host cache from then on. Jobs are done in the order they were
+// queued, so the save of a dropped user always lands before a later load of it.
+struct db_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_t thread;
+	bool started;
+	struct db_job *first;
+	struct db_job *last;
+};
+
+// Uuids of everyone who has placed a tile, so tiles only need a 32 bit id.
+// Id 0 is nobody. Ids are dense and persisted in user_ids, the ones from
+// stored_count onwards are new since the last save_canvas().
+struct uuid_table {
+	char (*uuids)[UUID_STR_LEN + 1]; // By id
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t stored_count;
+	struct uuid_index index; // uuid -> id
+};
+
+// Recently seen hosts by address, bounded to max_cached_hosts.
+// Least recently used ones get written back and evicted to make room.
+struct host_cache {
+	struct remote_host **buckets;
+	size_t bucket_mask;
+	size_t count;
+	struct remote_host *lru_first; // Most recently used
+	struct remote_host *lru_last;
+};
+
+struct canvas {
+	struct reactor *reactors;
+	size_t reactor_count;
+	// The users of every reactor by uuid. Only their reactors change them, see connect_user() and
+	// drop_user(). Other threads look them up under a read lock, and only read the uuid and socket
+	// of what they find while they hold it.
+	pthread_rwlock_t users_lock;
+	struct uuid_index user_index;
+	size_t connected_user_count; // Changed atomically
+	struct pool host_pool; // struct remote_host
+	struct host_cache hosts; // The db thread's once it's started
+	// Guards administrators and the color response, which load_config() replaces on reload.
+	// The rest of settings are scalars, reloaded in place.
+	pthread_mutex_t config_lock;
+	struct administrator *administrators;
+	size_t administrator_count;
+	// Tiles changed since the last save_canvas(), one bit per tile.
+	// A tile placed over and over between saves only gets written once. Changed atomically.
+	uint64_t *dirty_bitmap;
+	size_t dirty_tiles;
+	// One entry per tile in each. Colors are kept on their own so they can be compressed as is.
+	// Placing a tile needs no locks, see set_tile(). Everything reading them loads atomically.
+	uint8_t *tile_colors;
+	uint64_t *tile_place_times; // unix
+	uint32_t *tile_modifiers; // Interned uuid of whoever placed it last
+	pthread_mutex_t modifiers_lock; // Guards modifiers
+	struct uuid_table modifiers;
+	// Tiles queued on some reactor since the last RES_TILE_UPDATES went out, set atomically.
+	// The bitmap dedups, the queues of the reactors keep placement order.
+	uint8_t *pending_bitmap;
+	size_t pending_count; // In the queues of all reactors, changed atomically
+	// Orders broadcasts, so every reactor sees them in the same order. Also guards everything
+	// below up to dirty, which flush_tile_updates() changes as it sends a batch.
+	pthread_mutex_t broadcast_lock;
+	struct mg_iobuf flushing; // The queues of all reactors, merged
+	// The most recent tile updates sent, so reconnecting clients can catch up on just those.
+	// Each update gets the next sequence number, update_seq is the one the next gets.
+	struct tile_history_entry *update_history; // Ring of tile_update_history entries
+	size_t update_history_head; // Where the next one goes
+	size_t update_history_len;
+	uint32_t update_seq; // Also read atomically without broadcast_lock, see snapshot_dirty_chunks()
+	struct timeval last_update_flush;
+	bool dirty; // Changed atomically
 	uint32_t edge_length;
 	sqlite3 *backing_db; // For persistence
 	struct params settings;
-	struct color_list color_list;
+	struct color_list color_list; // Only load_config() changes it, amount is stored atomically
 	char *color_response_cache;
 	size_t color_response_cache_len;
 	pthread_t canvas_worker_thread;
+	pthread_mutex_t worker_lock; // Guards the two flags below, and goes with canvas_changed
+	pthread_cond_t canvas_changed; // Wakes the worker when the first chunk gets dirty, or to stop it
+	bool worker_stop;
+	bool cache_wanted; // Somebody is waiting for a frame, snapshot even if nothing is dirty
+	// Chunks changed since the last snapshot_dirty_chunks(), set by set_tile(). Changed atomically.
+	uint64_t *dirty_chunks; // Bitmap
+	bool chunks_dirty; // Some bit in dirty_chunks is set
+	// Guards levels, the blobs in them and palette.
+	// Only held to copy chunks in and out and to swap blobs, never while compressing.
+	pthread_mutex_t chunks_lock;
+	// Level 0 has a copy of tile_colors as of the last snapshot, so chunks get compressed from a
+	// consistent image while tiles keep getting placed. Only the dirty chunks get copied over.
+	struct chunk_plane levels[CANVAS_LEVELS];
+	uint64_t canvas_generation; // Bumped whenever any chunk version is
+	uint32_t snapshot_seq; // update_seq as of the last snapshot
+	// Owned by the worker. Copied out of levels, so the worker compresses without chunks_lock.
+	// It's also the only one replacing blobs, so it reads them without chunks_lock too.
+	struct level_copy level_copies[CANVAS_LEVELS];
+	struct canvas_palette palette_copy;
+	// Connected users getting the canvas in each format. The worker only keeps caches with some fresh.
+	// Changed atomically, a format getting its first user again under canvas_cache_lock.
+	uint32_t format_users[CANVAS_FORMAT_COUNT];
+	// For each level, a bit per codec regions were asked for in. The worker keeps the blobs of levels
+	// after 0 fresh for those, and clears the bits of codecs nobody uses anymore. Changed atomically.
+	uint32_t region_codecs[CANVAS_LEVELS];
 	pthread_mutex_t canvas_cache_lock;
-	uint8_t *canvas_cache;
-	size_t canvas_cache_len;
-	float canvas_cache_compression_ratio;
+	struct canvas_cache canvas_caches[CANVAS_FORMAT_COUNT];
+	struct canvas_palette palette; // Guarded by chunks_lock
+	struct compress_pool compressors;
+	struct backpressure_stats backpressure; // Updated atomically
+	struct db_queue db;
 };
 
 // rate limiting
 
-struct remote_host {
-	struct mg_addr addr;
-	size_t total_accounts;
-};
-
 long get_ms_delta(struct timeval timer) {
 	struct timeval tmr2;
 	gettimeofday(&tmr2, NULL);
@@ -145,9 +474,11 @@ long get_ms_delta(struct timeval timer) {
 // 'Token bucket' algorithm
 // This particular implementation is adapted from this SO answer:
 // https://stackoverflow.com/a/668327
-bool is_within_rate_limit(struct rate_limiter *limiter) {
+// Takes cost events' worth of allowance
+bool is_within_rate_limit_cost(struct rate_limiter *limiter, float cost) {
 #ifdef DISABLE_RATE_LIMITING
 	(void)limiter;
+	(void)cost;
 	return true;
 #else
 	if (!limiter->max_rate) {
@@ -164,25 +495,21 @@ bool is_within_rate_limit(struct rate_limiter *limiter) {
 	float secs_since_last = (float)ms_since_last_event / 1000.0f;
 	limiter->current_allowance += secs_since_last * (*limiter->max_rate / *limiter->per_seconds);
 	if (limiter->current_allowance > *limiter->max_rate) limiter->current_allowance = *limiter->max_rate;
-	if (limiter->current_allowance < 1.0f) {
+	if (limiter->current_allowance < cost) {
 		is_within_limit = false;
 	} else {
-		limiter->current_allowance -= 1.0f;
+		limiter->current_allowance -= cost;
 	}
 
 	return is_within_limit;
 #endif
 }
 
-// end rate limiting
-
-// timing
-
-void sleep_ms(int ms) {
-	usleep(ms * 1000);
+bool is_within_rate_limit(struct rate_limiter *limiter) {
+	return is_within_rate_limit_cost(limiter, 1.0f);
 }
 
-// end timing
+// end rate limiting
 
 static bool g_running = true;
 // These two below are triggered from a signal handler and polled in main runloop
@@ -191,8 +518,20 @@ static bool g_do_db_backup = false;
 
 // common request handling logic
 
-void start_user_timer(struct user *user, struct mg_mgr *mgr);
-void send_user_count(const struct canvas *c);
+void start_user_timers(struct user *user);
+void stop_user_timers(struct user *user);
+static struct db_job *db_job_for(struct mg_connection *connection, enum db_job_type type);
+static void queue_db_job(struct canvas *c, struct db_job *job);
+void send_user_count(struct canvas *c);
+void kick_with_message(struct canvas *c, struct user *user, const char *message, const char *reconnect_btn_text, struct db_job *then);
+void snapshot_dirty_chunks(struct canvas *c);
+static void want_canvas_cache(struct canvas *c);
+static struct mg_shared *frame_with_catch_up(struct reactor *r, size_t format, struct mg_shared **catch_up);
+static void take_region(struct canvas *c, struct region_reply *reply);
+static uint8_t *finish_region(struct region_reply *reply, size_t *message_len);
+static void use_canvas_format(struct canvas *c, size_t format);
+static void leave_canvas_format(struct canvas *c, size_t format);
+void update_canvas_palette(struct canvas *c);
 
 struct tile_update {
 	uint8_t resp_type;
@@ -211,19 +550,415 @@ enum response_id {
 	RES_TILE_INCREMENT,
 	RES_LEVEL_UP,
 	RES_USER_COUNT,
+	RES_TILE_UPDATES,
+	RES_CANVAS_CHUNKS,
+	RES_CANVAS_PACKED,
+	RES_CANVAS_REGION,
 	ERR_INVALID_UUID = 128,
 	ERR_OUT_OF_TILES,
 	ERR_RATE_LIMIT_EXCEEDED,
 };
 
-void bin_broadcast(const struct canvas *c, const char *payload, size_t len) {
-	struct list_elem *elem = NULL;
-	list_foreach_ro(elem, c->connected_users) {
-		struct user *user = (struct user *)elem->thing;
-		mg_ws_send(user->socket, payload, len, WEBSOCKET_OP_BINARY);
+// reactors
+
+// The reactor running on the current thread
+static __thread struct reactor *t_reactor = NULL;
+
+enum mail_type {
+	MAIL_BROADCAST = 0,
+	MAIL_TILE_UPDATES, // Broadcast that slow clients can skip
+	MAIL_KICK,
+	MAIL_AUTH, // A struct auth_reply from the db thread
+	MAIL_REPLY, // A response from the db thread, sent as is
+	MAIL_SET_NAME, // A struct name_reply
+	MAIL_SHADOW_BAN, // A struct ban_notice, to every reactor
+};
+
+struct mail_header {
+	uint8_t type;
+	uint8_t op;
+	unsigned long conn_id;
+	struct mg_shared *frame; // MAIL_BROADCAST
+	struct mg_shared *deflated; // MAIL_BROADCAST, compressed frame or NULL
+	struct db_job *then; // MAIL_KICK, queued once the user is dropped, or NULL
+	size_t len; // Payload bytes following this header
+};
+
+// How DB_AUTH or DB_INITIAL_AUTH went
+struct auth_reply {
+	const char *error; // A string literal, NULL if it went through
+	bool is_new;
+	bool legacy_canvas;
+	enum codec_id codec;
+	struct user user; // As loaded or made, not connected yet
+};
+
+// The nickname user took, now that it's stored
+struct name_reply {
+	char uuid[UUID_STR_LEN + 1];
+	char name[MAX_NICK_LEN];
+};
+
+struct ban_notice {
+	char uuid[UUID_STR_LEN + 1];
+	bool is_shadow_banned;
+};
+
+// A message from a connection that's still being authenticated, see hold_message()
+struct held_message {
+	unsigned long conn_id;
+	uint8_t op;
+	size_t len; // Data bytes following this header
+};
+
+static struct reactor *conn_reactor(const struct mg_connection *conn) {
+	return (struct reactor *)conn->mgr->userdata;
+}
+
+static void post_header(struct reactor *r, const struct mail_header *header, const char *payload) {
+	pthread_mutex_lock(&r->mailbox_lock);
+	bool was_empty = r->mailbox.len == 0;
+	mg_iobuf_add(&r->mailbox, r->mailbox.len, header, sizeof(*header), MG_IO_SIZE);
+	if (header->len) mg_iobuf_add(&r->mailbox, r->mailbox.len, payload, header->len, MG_IO_SIZE);
+	pthread_mutex_unlock(&r->mailbox_lock);
+	// One poke is enough to get the whole mailbox drained
+	if (was_empty) send(r->wakeup_fd, "", 1, MSG_DONTWAIT);
+}
+
+void post_mail(struct reactor *r, enum mail_type type, unsigned long conn_id, struct mg_shared *frame, struct mg_shared *deflated, const char *payload, size_t len, int op) {
+	struct mail_header header = {
+		.type = type,
+		.op = op,
+		.conn_id = conn_id,
+		.frame = frame,
+		.deflated = deflated,
+		.len = len,
+	};
+	if (frame) mg_shared_ref(frame);
+	if (deflated) mg_shared_ref(deflated);
+	post_header(r, &header, payload);
+}
+
+// Has the owner of conn_id send it message and drop its user, and queue then after that
+static void post_kick(struct reactor *r, unsigned long conn_id, const char *message, struct db_job *then) {
+	struct mail_header header = {
+		.type = MAIL_KICK,
+		.op = WEBSOCKET_OP_TEXT,
+		.conn_id = conn_id,
+		.then = then,
+		.len = strlen(message),
+	};
+	post_header(r, &header, message);
+}
+
+// Must be called with broadcast_lock held, so every reactor sees broadcasts in the same order.
+// The message is framed once, and every recipient queues a reference to that same frame.
+static void post_broadcast_locked(struct canvas *c, enum mail_type type, const char *payload, size_t len, int op) {
+	struct mg_shared *frame = mg_ws_shared(payload, len, op);
+	if (!frame) return;
+	// Sockets without deflate context takeover can all share one compressed copy too
+	struct mg_shared *deflated = NULL;
+	if (c->settings.ws_deflate && !c->settings.ws_deflate_context_takeover) {
+		deflated = mg_ws_shared_deflate(payload, len, op);
+	}
+	for (size_t i = 0; i < c->reactor_count; ++i) {
+		post_mail(&c->reactors[i], type, 0, frame, deflated, NULL, 0, op);
+	}
+	mg_shared_unref(frame);
+	if (deflated) mg_shared_unref(deflated);
+}
+
+void post_broadcast(struct canvas *c, enum mail_type type, const char *payload, size_t len, int op) {
+	pthread_mutex_lock(&c->broadcast_lock);
+	post_broadcast_locked(c, type, payload, len, op);
+	pthread_mutex_unlock(&c->broadcast_lock);
+}
+
+void bin_broadcast(struct canvas *c, const char *payload, size_t len) {
+	post_broadcast(c, MAIL_BROADCAST, payload, len, WEBSOCKET_OP_BINARY);
+}
+
+void reactor_add_socket(struct user *user) {
+	struct reactor *r = conn_reactor(user->socket);
+	user->needs_resync = false;
+	ilist_push_back(&r->sockets, &user->reactor_node);
+}
+
+// Where user is in the subscribers of the chunk at x, y of its subscription
+static uint32_t *subscription_slot(struct user *user, size_t x, size_t y) {
+	const struct chunk_rect *rect = &user->subscription;
+	return &user->subscription_slots[(x - rect->x) + (y - rect->y) * rect->width];
+}
+
+// Takes whoever is at slot out of the subscribers of the chunk at x, y. The last one moves into its place.
+static void chunk_subscribers_remove(struct chunk_subscribers *s, uint32_t slot, size_t x, size_t y) {
+	struct user *last = s->users[--s->count];
+	s->users[slot] = last;
+	*subscription_slot(last, x, y) = slot;
+}
+
+// Only send user tile updates for the chunks in rect from here on, or all of them again if rect is NULL.
+// Must be called on the reactor that owns user->socket.
+void reactor_subscribe(struct user *user, const struct chunk_rect *rect) {
+	struct reactor *r = conn_reactor(user->socket);
+	uint32_t chunks_per_edge = r->canvas->levels[0].chunks_per_edge;
+	if (user->is_subscribed) {
+		const struct chunk_rect *old = &user->subscription;
+		for (size_t y = old->y; y < old->y + old->height; ++y) {
+			for (size_t x = old->x; x < old->x + old->width; ++x) {
+				chunk_subscribers_remove(&r->subscribers[x + y * chunks_per_edge], *subscription_slot(user, x, y), x, y);
+			}
+		}
+		user->is_subscribed = false;
+		r->subscribed_count--;
+	}
+	if (!rect) return;
+	if (!r->subscribers) r->subscribers = calloc((size_t)chunks_per_edge * chunks_per_edge, sizeof(*r->subscribers));
+	user->subscription = *rect;
+	user->subscription_slots = realloc(user->subscription_slots, (size_t)rect->width * rect->height * sizeof(*user->subscription_slots));
+	for (size_t y = rect->y; y < rect->y + rect->height; ++y) {
+		for (size_t x = rect->x; x < rect->x + rect->width; ++x) {
+			struct chunk_subscribers *s = &r->subscribers[x + y * chunks_per_edge];
+			if (s->count == s->capacity) {
+				s->capacity = s->capacity ? s->capacity * 2 : 4;
+				s->users = realloc(s->users, s->capacity * sizeof(*s->users));
+			}
+			*subscription_slot(user, x, y) = s->count;
+			s->users[s->count++] = user;
+		}
+	}
+	user->is_subscribed = true;
+	r->subscribed_count++;
+	r->touched = realloc(r->touched, r->subscribed_count * sizeof(*r->touched));
+}
+
+void reactor_remove_socket(struct user *user) {
+	struct reactor *r = conn_reactor(user->socket);
+	if (user->needs_resync) r->resyncs_pending--;
+	reactor_subscribe(user, NULL);
+	free(user->subscription_slots);
+	user->subscription_slots = NULL;
+	mg_iobuf_free(&user->filtered_updates);
+	ilist_remove(&r->sockets, &user->reactor_node);
+}
+
+// end reactors
+
+// Persisted by the next save_canvas(), every canvas_save_interval_sec seconds
+void mark_tile_dirty(struct canvas *c, size_t i) {
+	uint64_t bit = 1ULL << (i % 64);
+	if (!(__atomic_fetch_or(&c->dirty_bitmap[i / 64], bit, __ATOMIC_RELAXED) & bit)) {
+		__atomic_add_fetch(&c->dirty_tiles, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&c->dirty, true, __ATOMIC_RELAXED);
+}
+
+// Picked up by the next snapshot_dirty_chunks(). Only the first chunk to get dirty wakes the worker.
+static void dirty_chunk(struct canvas *c, size_t chunk) {
+	uint64_t bit = 1ULL << (chunk % 64);
+	if (__atomic_fetch_or(&c->dirty_chunks[chunk / 64], bit, __ATOMIC_RELEASE) & bit) return;
+	if (__atomic_exchange_n(&c->chunks_dirty, true, __ATOMIC_ACQ_REL)) return;
+	pthread_mutex_lock(&c->worker_lock);
+	pthread_cond_signal(&c->canvas_changed);
+	pthread_mutex_unlock(&c->worker_lock);
+}
+
+void mark_chunk_dirty(struct canvas *c, size_t i) {
+	size_t x = i % c->edge_length;
+	size_t y = i / c->edge_length;
+	dirty_chunk(c, (x / CANVAS_CHUNK_EDGE) + (y / CANVAS_CHUNK_EDGE) * c->levels[0].chunks_per_edge);
+}
+
+// uuid interning
+
+static void uuid_table_reserve(struct uuid_table *t, uint32_t capacity) {
+	if (capacity <= t->capacity) return;
+	uint32_t new_capacity = t->capacity ? t->capacity : 64;
+	while (new_capacity < capacity) new_capacity *= 2;
+	t->uuids = realloc(t->uuids, new_capacity * sizeof(*t->uuids));
+	memset(t->uuids + t->capacity, 0, (new_capacity - t->capacity) * sizeof(*t->uuids));
+	t->capacity = new_capacity;
+	// The index points into uuids, so it has to follow them
+	uuid_index_destroy(&t->index);
+	for (uint32_t id = 1; id < t->count; ++id) {
+		if (t->uuids[id][0]) uuid_index_put(&t->index, t->uuids[id], (void *)(uintptr_t)id);
+	}
+}
+
+static void uuid_table_set(struct uuid_table *t, uint32_t id, const char *uuid) {
+	uuid_table_reserve(t, id + 1);
+	if (id >= t->count) t->count = id + 1;
+	strncpy(t->uuids[id], uuid, UUID_STR_LEN);
+	uuid_index_put(&t->index, t->uuids[id], (void *)(uintptr_t)id);
+}
+
+uint32_t intern_uuid(struct canvas *c, const char *uuid) {
+	if (!uuid || !uuid[0]) return 0;
+	pthread_mutex_lock(&c->modifiers_lock);
+	uint32_t id = (uint32_t)(uintptr_t)uuid_index_find(&c->modifiers.index, uuid);
+	if (!id) {
+		id = c->modifiers.count ? c->modifiers.count : 1;
+		uuid_table_set(&c->modifiers, id, uuid);
+	}
+	pthread_mutex_unlock(&c->modifiers_lock);
+	return id;
+}
+
+// Copies the uuid out, the table moves as it grows. Empty if there is none.
+void uuid_for_id(struct canvas *c, uint32_t id, char uuid[UUID_STR_LEN + 1]) {
+	uuid[0] = '\0';
+	pthread_mutex_lock(&c->modifiers_lock);
+	if (id && id < c->modifiers.count) {
+		memcpy(uuid, c->modifiers.uuids[id], UUID_STR_LEN);
+		uuid[UUID_STR_LEN] = '\0';
+	}
+	pthread_mutex_unlock(&c->modifiers_lock);
+}
+
+// end uuid interning
+
+// tile update coalescing
+
+// Wire format of RES_TILE_UPDATES is the response id, the sequence number of the first entry
+// as a u32, and then (u32 tile index, u8 color_id) pairs, packed. The entries are numbered
+// consecutively. Everything in network byte order.
+#define TILE_UPDATES_HEADER_LEN 5
+#define TILE_UPDATE_ENTRY_SIZE 5
+
+static uint8_t *put_tile_updates_header(uint8_t *frame, uint32_t first_seq) {
+	frame[0] = RES_TILE_UPDATES;
+	uint32_t seq_be = htonl(first_seq);
+	memcpy(frame + 1, &seq_be, sizeof(seq_be));
+	return frame + TILE_UPDATES_HEADER_LEN;
+}
+
+static uint8_t *put_tile_update(uint8_t *pos, uint32_t i, uint8_t color_id) {
+	uint32_t i_be = htonl(i);
+	memcpy(pos, &i_be, sizeof(i_be));
+	pos[4] = color_id;
+	return pos + TILE_UPDATE_ENTRY_SIZE;
+}
+
+// Must be called with broadcast_lock held
+static void record_tile_update(struct canvas *c, uint32_t i, uint8_t color_id) {
+	size_t size = c->settings.tile_update_history;
+	c->update_history[c->update_history_head] = (struct tile_history_entry){ .i = i, .color_id = color_id };
+	c->update_history_head = (c->update_history_head + 1) % size;
+	if (c->update_history_len < size) c->update_history_len++;
+	__atomic_store_n(&c->update_seq, c->update_seq + 1, __ATOMIC_RELEASE);
+}
+
+// Must be called with broadcast_lock held, and seq within the last update_history_len
+static const struct tile_history_entry *tile_history_entry(const struct canvas *c, uint32_t seq) {
+	size_t size = c->settings.tile_update_history;
+	size_t back = (uint32_t)(c->update_seq - seq); // 1 for the latest one
+	return &c->update_history[(c->update_history_head + size - back) % size];
+}
+
+// Must be called with broadcast_lock held, and all count of them within the last update_history_len.
+// RES_TILE_UPDATES with the count updates from first_seq on, from the history.
+static uint8_t *tile_updates_since(const struct canvas *c, uint32_t first_seq, uint32_t count, size_t *len) {
+	*len = TILE_UPDATES_HEADER_LEN + (size_t)count * TILE_UPDATE_ENTRY_SIZE;
+	uint8_t *frame = malloc(*len);
+	uint8_t *pos = put_tile_updates_header(frame, first_seq);
+	for (uint32_t n = 0; n < count; ++n) {
+		const struct tile_history_entry *entry = tile_history_entry(c, first_seq + n);
+		pos = put_tile_update(pos, entry->i, entry->color_id);
+	}
+	return frame;
+}
+
+// The sequence number the batch after a RES_TILE_UPDATES frame starts from
+static uint32_t tile_updates_end_seq(struct mg_str data) {
+	uint32_t first_seq;
+	memcpy(&first_seq, data.ptr + 1, sizeof(first_seq));
+	return ntohl(first_seq) + (uint32_t)((data.len - TILE_UPDATES_HEADER_LEN) / TILE_UPDATE_ENTRY_SIZE);
+}
+
+// The entries of a RES_TILE_UPDATES frame as one RES_TILE_UPDATE message each, for legacy_canvas
+// clients that don't know the batched one. Framed once, so a batch costs them one shared send.
+static struct mg_shared *legacy_tile_updates(const uint8_t *frame, size_t len) {
+	size_t count = (len - TILE_UPDATES_HEADER_LEN) / TILE_UPDATE_ENTRY_SIZE;
+	struct tile_update *updates = calloc(count, sizeof(*updates));
+	for (size_t n = 0; n < count; ++n) {
+		const uint8_t *entry = frame + TILE_UPDATES_HEADER_LEN + n * TILE_UPDATE_ENTRY_SIZE;
+		updates[n].resp_type = RES_TILE_UPDATE;
+		updates[n].color_id = entry[4];
+		memcpy(&updates[n].i, entry, sizeof(updates[n].i)); // Already in network byte order
+	}
+	struct mg_shared *frames = mg_ws_shared_many((const char *)updates, count, sizeof(*updates), WEBSOCKET_OP_BINARY);
+	free(updates);
+	return frames;
+}
+
+// Queued on the reactor the tile was placed on, or on the first one when that isn't a reactor thread
+void queue_tile_update(struct canvas *c, uint32_t i) {
+	uint8_t bit = 1 << (i % 8);
+	if (__atomic_fetch_or(&c->pending_bitmap[i / 8], bit, __ATOMIC_ACQ_REL) & bit) return; // Already queued, flush picks up the latest color
+	struct reactor *r = t_reactor ? t_reactor : &c->reactors[0];
+	// Counted first, so a flush never takes more than were counted
+	__atomic_add_fetch(&c->pending_count, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&r->pending_lock);
+	mg_iobuf_add(&r->pending_updates, r->pending_updates.len, &i, sizeof(i), MG_IO_SIZE);
+	pthread_mutex_unlock(&r->pending_lock);
+}
+
+// Needs no locks, tiles get placed on every reactor at once. The color is stored last,
+// so whoever sees it queued sees it, see flush_tile_updates().
+void set_tile(struct canvas *c, size_t i, uint8_t color_id, uint64_t place_time_unix, uint32_t modifier_id) {
+	__atomic_store_n(&c->tile_place_times[i], place_time_unix, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->tile_modifiers[i], modifier_id, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->tile_colors[i], color_id, __ATOMIC_RELEASE);
+	mark_tile_dirty(c, i);
+	mark_chunk_dirty(c, i);
+	queue_tile_update(c, i);
+}
+
+// Send everything placed since the last flush as one frame.
+// Called by every reactor after each poll, whichever gets here first does the work.
+void flush_tile_updates(struct canvas *c) {
+	if (!__atomic_load_n(&c->pending_count, __ATOMIC_ACQUIRE)) return;
+	pthread_mutex_lock(&c->broadcast_lock);
+	if (c->settings.tile_update_interval_ms && get_ms_delta(c->last_update_flush) < (long)c->settings.tile_update_interval_ms) goto out;
+	c->flushing.len = 0;
+	for (size_t n = 0; n < c->reactor_count; ++n) {
+		struct reactor *r = &c->reactors[n];
+		pthread_mutex_lock(&r->pending_lock);
+		mg_iobuf_add(&c->flushing, c->flushing.len, r->pending_updates.buf, r->pending_updates.len, MG_IO_SIZE);
+		r->pending_updates.len = 0;
+		pthread_mutex_unlock(&r->pending_lock);
 	}
+	size_t count = c->flushing.len / sizeof(uint32_t);
+	if (!count) goto out;
+	__atomic_sub_fetch(&c->pending_count, count, __ATOMIC_RELAXED);
+	gettimeofday(&c->last_update_flush, NULL);
+
+	size_t len = TILE_UPDATES_HEADER_LEN + count * TILE_UPDATE_ENTRY_SIZE;
+	uint8_t *frame = malloc(len);
+	const uint32_t *indices = (const uint32_t *)c->flushing.buf;
+	uint8_t *pos = put_tile_updates_header(frame, c->update_seq);
+	for (size_t n = 0; n < count; ++n) {
+		uint32_t i = indices[n];
+		// Unqueued before the color is read, so a tile placed from here on gets queued again
+		__atomic_fetch_and(&c->pending_bitmap[i / 8], (uint8_t)~(1 << (i % 8)), __ATOMIC_ACQ_REL);
+		uint8_t color_id = __atomic_load_n(&c->tile_colors[i], __ATOMIC_ACQUIRE);
+		pos = put_tile_update(pos, i, color_id);
+		record_tile_update(c, i, color_id);
+	}
+	post_broadcast_locked(c, MAIL_TILE_UPDATES, (const char *)frame, len, WEBSOCKET_OP_BINARY);
+	free(frame);
+out:
+	pthread_mutex_unlock(&c->broadcast_lock);
+}
+
+// How long a reactor may block in poll without delaying a flush
+int tile_update_poll_ms(const struct canvas *c) {
+	size_t interval = c->settings.tile_update_interval_ms;
+	return interval && interval < 1000 ? (int)interval : 1000;
 }
 
+// end tile update coalescing
+
 void generate_uuid(char *buf) {
 	if (!buf) return;
 	uuid_t uuid;
@@ -254,13 +989,11 @@ void send_json(const cJSON *payload, const struct user *user) {
 	free(str);
 }
 
-void broadcast(const struct canvas *c, const cJSON *payload) {
-	//FIXME: Make list_foreach more ergonomic
-	struct list_elem *elem = NULL;
-	list_foreach_ro(elem, c->connected_users) {
-		struct user *user = (struct user *)elem->thing;
-		send_json(payload, user);
-	}
+void broadcast(struct canvas *c, const cJSON *payload) {
+	char *str = cJSON_PrintUnformatted(payload);
+	if (!str) return;
+	post_broadcast(c, MAIL_BROADCAST, str, strlen(str), WEBSOCKET_OP_TEXT);
+	free(str);
 }
 
 struct remote_host *try_load_host(struct canvas *c, struct mg_addr addr) {
@@ -281,11 +1014,12 @@ struct remote_host *try_load_host(struct canvas *c, struct mg_addr addr) {
 
 	struct remote_host *host = NULL;
 	if (step != SQLITE_ROW) {
+		sqlite3_finalize(query);
 		return NULL;
 	}
 
 	size_t i = 1;
-	host = calloc(1, sizeof(*host));
+	host = pool_alloc(&c->host_pool);
 
 	const char *user_name = (const char *)sqlite3_column_text(query, i++);
 	mg_aton(mg_str(user_name), &host->addr);
@@ -352,53 +1086,154 @@ void save_host(struct canvas *c, const struct remote_host *host) {
 	sqlite3_finalize(query);
 }
 
+// Hosts are per IP, so the port doesn't count. Neither does struct padding.
 bool mg_addr_eq(struct mg_addr a, struct mg_addr b) {
-	return memcmp(&a, &b, sizeof(a)) == 0;
+	if (a.is_ip6 != b.is_ip6) return false;
+	if (a.is_ip6) return memcmp(a.ip6, b.ip6, sizeof(a.ip6)) == 0;
+	return a.ip == b.ip;
+}
+
+// FNV-1a
+size_t mg_addr_hash(struct mg_addr addr) {
+	const uint8_t *bytes = addr.is_ip6 ? addr.ip6 : (const uint8_t *)&addr.ip;
+	size_t len = addr.is_ip6 ? sizeof(addr.ip6) : sizeof(addr.ip);
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Sizes the buckets for capacity hosts, relinking the ones already cached
+void host_cache_resize(struct host_cache *cache, size_t capacity) {
+	size_t buckets = 64;
+	while (buckets < capacity) buckets *= 2;
+	if (cache->buckets && buckets == cache->bucket_mask + 1) return;
+	free(cache->buckets);
+	cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+	cache->bucket_mask = buckets - 1;
+	for (struct remote_host *host = cache->lru_first; host; host = host->lru_next) {
+		struct remote_host **bucket = &cache->buckets[mg_addr_hash(host->addr) & cache->bucket_mask];
+		host->hash_next = *bucket;
+		*bucket = host;
+	}
+}
+
+void host_cache_init(struct host_cache *cache, size_t capacity) {
+	*cache = (struct host_cache){ 0 };
+	host_cache_resize(cache, capacity);
+}
+
+// Hosts themselves live in host_pool
+void host_cache_destroy(struct host_cache *cache) {
+	free(cache->buckets);
+	*cache = (struct host_cache){ 0 };
+}
+
+static void lru_unlink(struct host_cache *cache, struct remote_host *host) {
+	if (host->lru_prev) host->lru_prev->lru_next = host->lru_next;
+	else cache->lru_first = host->lru_next;
+	if (host->lru_next) host->lru_next->lru_prev = host->lru_prev;
+	else cache->lru_last = host->lru_prev;
+	host->lru_prev = NULL;
+	host->lru_next = NULL;
+}
+
+static void lru_push_front(struct host_cache *cache, struct remote_host *host) {
+	host->lru_next = cache->lru_first;
+	if (cache->lru_first) cache->lru_first->lru_prev = host;
+	else cache->lru_last = host;
+	cache->lru_first = host;
+}
+
+void flush_host(struct canvas *c, struct remote_host *host) {
+	if (!host->dirty) return;
+	if (host->stored) {
+		save_host(c, host);
+	} else {
+		add_host(c, host);
+		host->stored = true;
+	}
+	host->dirty = false;
+}
+
+// Write back all hosts with changes
+void save_hosts(struct canvas *c) {
+	for (struct remote_host *host = c->hosts.lru_first; host; host = host->lru_next) {
+		flush_host(c, host);
+	}
+}
+
+// Must be called on the db thread, once it's started
+static void evict_hosts(struct canvas *c) {
+	struct host_cache *cache = &c->hosts;
+	while (cache->count > c->settings.max_cached_hosts && cache->lru_last) {
+		struct remote_host *host = cache->lru_last;
+		flush_host(c, host);
+		struct remote_host **link = &cache->buckets[mg_addr_hash(host->addr) & cache->bucket_mask];
+		while (*link != host) link = &(*link)->hash_next;
+		*link = host->hash_next;
+		lru_unlink(cache, host);
+		cache->count--;
+		pool_free(&c->host_pool, host);
+	}
 }
 
 struct remote_host *find_host(struct canvas *c, struct mg_addr addr) {
-	struct list_elem *elem = NULL;
-	list_foreach_ro(elem, c->connected_hosts) {
-		struct remote_host *host = (struct remote_host *)elem->thing;
-		if (mg_addr_eq(host->addr, addr)) return host;
+	struct host_cache *cache = &c->hosts;
+	struct remote_host **bucket = &cache->buckets[mg_addr_hash(addr) & cache->bucket_mask];
+	for (struct remote_host *host = *bucket; host; host = host->hash_next) {
+		if (!mg_addr_eq(host->addr, addr)) continue;
+		lru_unlink(cache, host);
+		lru_push_front(cache, host);
+		return host;
 	}
+
 	struct remote_host *host = try_load_host(c, addr);
 	if (host) {
-		struct remote_host *hptr = list_append(c->connected_hosts, *host)->thing;
-		free(host);
-		return hptr;
+		host->stored = true;
+	} else {
+		// Written on the next save_hosts(), or when evicted
+		host = pool_alloc(&c->host_pool);
+		host->addr = addr;
+		host->dirty = true;
 	}
-
-	struct remote_host new = {
-		.addr = addr,
-	};
-	host = list_append(c->connected_hosts, new)->thing;
-	add_host(c, host);
-
+	host->hash_next = *bucket;
+	*bucket = host;
+	lru_push_front(cache, host);
+	cache->count++;
+	evict_hosts(c);
 	return host;
 }
 
-struct remote_host *extract_host(struct canvas *c, struct mg_connection *socket) {
+// The client address from the label, for find_host()
+bool extract_addr(struct mg_connection *socket, struct mg_addr *addr) {
 	if (strlen(socket->label)) { //TODO: Needed?
-		struct mg_addr remote_addr;
-		if (mg_aton(mg_str(socket->label), &remote_addr)) {
-			return find_host(c, remote_addr);
+		if (mg_aton(mg_str(socket->label), addr)) {
+			return true;
 		} else {
 			logr("Failed to convert peer address\n");
 		}
 	} else {
 		logr("No peer address\n");
 	}
-	return NULL;
+	return false;
 }
 
+// Must be called with users_lock held, see struct canvas
 struct user *find_in_connected_users(const struct canvas *c, const char *uuid) {
-	struct list_elem *head = NULL;
-	list_foreach_ro(head, c->connected_users) {
-		struct user *user = (struct user *)head->thing;
-		if (strncmp(user->uuid, uuid, UUID_STR_LEN) == 0) return user;
-	}
-	return NULL;
+	return uuid_index_find(&c->user_index, uuid);
+}
+
+// Binary requests may only act on the user that is bound to the requesting connection.
+struct user *conn_user(const struct mg_connection *connection) {
+	return (struct user *)connection->fn_data;
+}
+
+// Which of canvas_caches user gets the canvas from
+static size_t canvas_format(const struct user *user) {
+	return user->legacy_canvas ? CANVAS_FORMAT_LEGACY : user->codec;
 }
 
 void assign_rate_limiter_limit(struct rate_limiter *limiter, float *max_rate, float *per_seconds) {
@@ -410,8 +1245,36 @@ void assign_rate_limiter_limit(struct rate_limiter *limiter, float *max_rate, fl
 	limiter->per_seconds = per_seconds;
 }
 
+// Adds a copy of user to the reactor of socket, and binds it to socket.
+// It gets the canvas in the format the client asked for, see parse_codecs().
+// Another session of it that got in first is kicked.
+struct user *connect_user(struct canvas *c, const struct user *user, struct mg_connection *socket, bool legacy_canvas, enum codec_id codec) {
+	struct user *uptr = pool_alloc(&conn_reactor(socket)->user_pool);
+	*uptr = *user;
+	uptr->socket = socket;
+	uptr->codec = codec;
+	uptr->legacy_canvas = legacy_canvas;
+	assign_rate_limiter_limit(&uptr->subscribe_limiter, &c->settings.subscribe_max_rate, &c->settings.subscribe_per_seconds);
+	uptr->subscribe_limiter.current_allowance = c->settings.subscribe_max_rate;
+	gettimeofday(&uptr->subscribe_limiter.last_event_time, NULL);
+	use_canvas_format(c, canvas_format(uptr));
+	reactor_add_socket(uptr);
+	socket->fn_data = uptr;
+	pthread_rwlock_wrlock(&c->users_lock);
+	struct user *other = find_in_connected_users(c, uptr->uuid);
+	uuid_index_put(&c->user_index, uptr->uuid, uptr);
+	// One on another reactor is only posted a kick, which needs users_lock to read its socket
+	bool is_remote = other && conn_reactor(other->socket) != t_reactor;
+	if (is_remote) kick_with_message(c, other, "It looks like you opened another tab?", "Reconnect here", NULL);
+	pthread_rwlock_unlock(&c->users_lock);
+	if (other) logr("Kicking %s, they opened a new session\n", uptr->uuid);
+	if (other && !is_remote) kick_with_message(c, other, "It looks like you opened another tab?", "Reconnect here", NULL);
+	return uptr;
+}
+
+// The nickname and shadowban are left alone, those are stored as they're set. See run_db_job().
 void save_user(struct canvas *c, const struct user *user) {
-	const char *sql = "UPDATE users SET username = ?, remainingTiles = ?, tileRegenSeconds = ?, totalTilesPlaced = ?, lastConnected = ?, level = ?, hasSetUsername = ?, isShadowBanned = ?, maxTiles = ?, tilesToNextLevel = ?, levelProgress = ?, cl_last_event_sec = ?, cl_last_event_usec = ?, cl_current_allowance = ?, cl_max_rate = ?, cl_per_seconds = ?, tl_last_event_sec = ?, tl_last_event_usec = ?, tl_current_allowance = ?, tl_max_rate = ?, tl_per_seconds = ? WHERE uuid = ?";
+	const char *sql = "UPDATE users SET remainingTiles = ?, tileRegenSeconds = ?, totalTilesPlaced = ?, lastConnected = ?, level = ?, maxTiles = ?, tilesToNextLevel = ?, levelProgress = ?, cl_last_event_sec = ?, cl_last_event_usec = ?, cl_current_allowance = ?, cl_max_rate = ?, cl_per_seconds = ?, tl_last_event_sec = ?, tl_last_event_usec = ?, tl_current_allowance = ?, tl_max_rate = ?, tl_per_seconds = ? WHERE uuid = ?";
 	sqlite3_stmt *query;
 	int ret = sqlite3_prepare_v2(c->backing_db, sql, -1, &query, 0);
 	if (ret != SQLITE_OK) {
@@ -421,14 +1284,11 @@ void save_user(struct canvas *c, const struct user *user) {
 		exit(-1);
 	}
 	int idx = 1;
-	ret = sqlite3_bind_text(query, idx++, user->user_name, strlen(user->user_name), NULL);
 	ret = sqlite3_bind_int(query, idx++, user->remaining_tiles);
 	ret = sqlite3_bind_int(query, idx++, user->tile_regen_seconds);
 	ret = sqlite3_bind_int(query, idx++, user->total_tiles_placed);
 	ret = sqlite3_bind_int64(query, idx++, user->last_connected_unix);
 	ret = sqlite3_bind_int(query, idx++, user->level);
-	ret = sqlite3_bind_int(query, idx++, str_eq(user->user_name, "Anonymous") ? 1 : 0);
-	ret = sqlite3_bind_int(query, idx++, user->is_shadow_banned);
 	ret = sqlite3_bind_int(query, idx++, user->max_tiles);
 	ret = sqlite3_bind_int(query, idx++, user->tiles_to_next_level);
 	ret = sqlite3_bind_int(query, idx++, user->current_level_progress);
@@ -454,6 +1314,49 @@ void save_user(struct canvas *c, const struct user *user) {
 	sqlite3_finalize(query);
 }
 
+// Sets the columns save_user() leaves alone. Stored right away, so a save of an older copy can't undo them.
+void store_user_name(struct canvas *c, const char *uuid, const char *name) {
+	sqlite3_stmt *query;
+	int ret = sqlite3_prepare_v2(c->backing_db, "UPDATE users SET username = ?, hasSetUsername = ? WHERE uuid = ?", -1, &query, 0);
+	if (ret != SQLITE_OK) {
+		printf("Failed to prepare username update query: %s\n", sqlite3_errmsg(c->backing_db));
+		sqlite3_finalize(query);
+		sqlite3_close(c->backing_db);
+		exit(-1);
+	}
+	int idx = 1;
+	sqlite3_bind_text(query, idx++, name, strlen(name), NULL);
+	sqlite3_bind_int(query, idx++, str_eq(name, "Anonymous") ? 1 : 0);
+	sqlite3_bind_text(query, idx++, uuid, strlen(uuid), NULL);
+	if (sqlite3_step(query) != SQLITE_DONE) {
+		printf("Failed to update username: %s\n", sqlite3_errmsg(c->backing_db));
+		sqlite3_finalize(query);
+		sqlite3_close(c->backing_db);
+		exit(-1);
+	}
+	sqlite3_finalize(query);
+}
+
+void store_shadow_ban(struct canvas *c, const char *uuid, bool is_shadow_banned) {
+	sqlite3_stmt *query;
+	int ret = sqlite3_prepare_v2(c->backing_db, "UPDATE users SET isShadowBanned = ? WHERE uuid = ?", -1, &query, 0);
+	if (ret != SQLITE_OK) {
+		printf("Failed to prepare shadowban update query: %s\n", sqlite3_errmsg(c->backing_db));
+		sqlite3_finalize(query);
+		sqlite3_close(c->backing_db);
+		exit(-1);
+	}
+	sqlite3_bind_int(query, 1, is_shadow_banned);
+	sqlite3_bind_text(query, 2, uuid, strlen(uuid), NULL);
+	if (sqlite3_step(query) != SQLITE_DONE) {
+		printf("Failed to update shadowban: %s\n", sqlite3_errmsg(c->backing_db));
+		sqlite3_finalize(query);
+		sqlite3_close(c->backing_db);
+		exit(-1);
+	}
+	sqlite3_finalize(query);
+}
+
 struct user *try_load_user(struct canvas *c, const char *uuid) {
 	sqlite3_stmt *query;
 	int ret = sqlite3_prepare_v2(c->backing_db, "SELECT * FROM users WHERE uuid = ?", -1, &query, 0);
@@ -541,21 +1444,40 @@ void add_user(struct canvas *c, const struct user *user) {
 	sqlite3_finalize(query);
 }
 
+// Has the db thread save a copy of user
+void queue_user_save(struct canvas *c, const struct user *user) {
+	struct db_job *job = calloc(1, sizeof(*job));
+	job->type = DB_SAVE_USERS;
+	job->save.users = malloc(sizeof(*user));
+	*job->save.users = *user;
+	job->save.count = 1;
+	queue_db_job(c, job);
+}
+
+// Must be called on the reactor that owns user->socket
+void drop_user(struct canvas *c, struct user *user) {
+	struct reactor *r = conn_reactor(user->socket);
+	__atomic_sub_fetch(&c->connected_user_count, 1, __ATOMIC_RELAXED);
+	leave_canvas_format(c, canvas_format(user));
+	user->last_connected_unix = (unsigned)time(NULL);
+	// Queued while it's still indexed, so a new session of it gets loaded after this lands
+	queue_user_save(c, user);
+	stop_user_timers(user);
+	reactor_remove_socket(user);
+	pthread_rwlock_wrlock(&c->users_lock);
+	uuid_index_remove(&c->user_index, user->uuid, user);
+	pthread_rwlock_unlock(&c->users_lock);
+	user->socket->fn_data = NULL;
+	user->socket->is_draining = 1;
+	pool_free(&r->user_pool, user);
+}
+
 void drop_user_with_connection(struct canvas *c, struct mg_connection *connection) {
-	list_foreach(c->connected_users, {
-		struct user *user = (struct user *)arg;
-		if (user->socket != connection) return;
-		c->connected_user_count--;
-		logr("User %s disconnected. (%4lu)\n", user->uuid, c->connected_user_count);
-		user->last_connected_unix = (unsigned)time(NULL);
-		save_user(c, user);
-		mg_timer_free(&c->mgr.timers, user->tile_increment_timer);
-		user->socket->is_draining = 1;
-		list_remove(c->connected_users, {
-			const struct user *list_user = (struct user *)arg;
-			return list_user->socket == user->socket;
-		});
-	});
+	// Only authenticated connections have a user bound to them
+	struct user *user = (struct user *)connection->fn_data;
+	if (!user) return;
+	logr("User %s disconnected. (%4lu)\n", user->uuid, __atomic_load_n(&c->connected_user_count, __ATOMIC_RELAXED) - 1);
+	drop_user(c, user);
 	send_user_count(c);
 }
 
@@ -579,13 +1501,34 @@ cJSON *color_to_json(struct color color) {
 	return c;
 }
 
-struct administrator *find_in_admins(struct canvas *c, const char *uuid) {
-	struct list_elem *elem = NULL;
-	list_foreach_ro(elem, c->administrators) {
-		struct administrator *admin = (struct administrator *)elem->thing;
-		if (str_eq(admin->uuid, uuid)) return admin;
+// Copied into admin, if it's not NULL, since a reload can replace the list at any time
+bool find_in_admins(struct canvas *c, const char *uuid, struct administrator *admin) {
+	bool found = false;
+	pthread_mutex_lock(&c->config_lock);
+	for (size_t i = 0; i < c->administrator_count; ++i) {
+		if (!str_eq(c->administrators[i].uuid, uuid)) continue;
+		if (admin) *admin = c->administrators[i];
+		found = true;
+		break;
 	}
-	return NULL;
+	pthread_mutex_unlock(&c->config_lock);
+	return found;
+}
+
+// Credit the tiles regenerated since last_regen_unix.
+// Time spent at max_tiles doesn't count towards the next one.
+void regen_tiles(struct user *user, uint64_t now_unix) {
+	if (user->remaining_tiles >= user->max_tiles || now_unix < user->last_regen_unix) {
+		user->last_regen_unix = now_unix;
+		return;
+	}
+	uint64_t periods = (now_unix - user->last_regen_unix) / user->tile_regen_seconds;
+	if (!periods) return;
+	uint32_t missing = user->max_tiles - user->remaining_tiles;
+	uint32_t added = periods < missing ? periods : missing;
+	user->remaining_tiles += added;
+	user->unsent_tiles += added;
+	user->last_regen_unix = added == missing ? now_unix : user->last_regen_unix + periods * user->tile_regen_seconds;
 }
 
 void level_up(struct user *user) {
@@ -594,6 +1537,7 @@ void level_up(struct user *user) {
 	user->tiles_to_next_level += 150;
 	user->current_level_progress = 0;
 	user->remaining_tiles = user->max_tiles;
+	user->unsent_tiles = 0;
 	if (user->tile_regen_seconds > 10) {
 		user->tile_regen_seconds--;
 	}
@@ -609,19 +1553,19 @@ void level_up(struct user *user) {
 	cJSON_Delete(response);
 }
 
-cJSON *handle_get_tile_info(struct canvas *c, const cJSON *user_id, const cJSON *x_param, const cJSON *y_param) {
+// The name of who placed the tile is looked up by the db thread, which sends the response
+cJSON *handle_get_tile_info(struct canvas *c, struct mg_connection *connection, const cJSON *user_id, const cJSON *x_param, const cJSON *y_param) {
 	if (!cJSON_IsString(user_id)) return error_response("Invalid userID");
 	if (!cJSON_IsNumber(x_param)) return error_response("X coordinate not a number");
 	if (!cJSON_IsNumber(y_param)) return error_response("Y coordinate not a number");
 
-	struct administrator *admin = find_in_admins(c, user_id->valuestring);
-	if (!admin) {
+	if (!find_in_admins(c, user_id->valuestring, NULL)) {
 		logr("Rejecting getTileInfo for unknown user %s. Naughty naughty!\n", user_id->valuestring);
 		return error_response("Invalid admin userID");
 	}
 
-	struct user *user = find_in_connected_users(c, user_id->valuestring);
-	if (!user) return error_response("Not authenticated");
+	struct user *user = conn_user(connection);
+	if (!user || !str_eq(user->uuid, user_id->valuestring)) return error_response("Not authenticated");
 
 	if (!is_within_rate_limit(&user->tile_limiter)) {
 		return NULL;
@@ -633,19 +1577,13 @@ cJSON *handle_get_tile_info(struct canvas *c, const cJSON *user_id, const cJSON
 	if (x > c->edge_length - 1) return error_response("Invalid X coordinate");
 	if (y > c->edge_length - 1) return error_response("Invalid Y coordinate");
 
-	struct tile *tile = &c->tiles[x + y * c->edge_length];
-	bool free_user = false;
-	struct user *queried_user = find_in_connected_users(c, tile->last_modifier);
-	if (!queried_user) {
-		queried_user = try_load_user(c, tile->last_modifier);
-		free_user = true;
-	}
-	cJSON *response = base_response("ti");
-	cJSON_AddStringToObject(response, "un", queried_user->user_name);
-	cJSON_AddNumberToObject(response, "pt", tile->place_time_unix);
-	if (free_user) free(queried_user);
+	size_t i = x + y * c->edge_length;
+	struct db_job *job = db_job_for(connection, DB_TILE_INFO);
+	uuid_for_id(c, __atomic_load_n(&c->tile_modifiers[i], __ATOMIC_RELAXED), job->uuid);
+	job->place_time = __atomic_load_n(&c->tile_place_times[i], __ATOMIC_RELAXED);
 	logr("Serving tileInfo for %s (%s) at %lu,%lu\n", user->uuid, user->user_name, x, y);
-	return response;
+	queue_db_job(c, job);
+	return NULL;
 }
 
 bool nick_taken(sqlite3 *db, const char *nick) {
@@ -674,18 +1612,20 @@ bool nick_taken(sqlite3 *db, const char *nick) {
 	return count > 0;
 }
 
-cJSON *handle_set_nickname(struct canvas *c, const cJSON *user_id, const cJSON *name) {
+// The db thread checks it's free and stores it, then the user takes it, see MAIL_SET_NAME
+cJSON *handle_set_nickname(struct canvas *c, struct mg_connection *connection, const cJSON *user_id, const cJSON *name) {
 	if (!cJSON_IsString(user_id)) return error_response("No userID provided");
 	if (!cJSON_IsString(name)) return error_response("No nickname provided");
 	if (strlen(name->valuestring) == 0) return error_response("No nickname provided");
-	struct user *user = find_in_connected_users(c, user_id->valuestring);
-	if (!user) return error_response("Not authenticated");
+	struct user *user = conn_user(connection);
+	if (!user || !str_eq(user->uuid, user_id->valuestring)) return error_response("Not authenticated");
 	if (strlen(name->valuestring) > sizeof(user->user_name)) return error_response("Nickname too long");
-	if (nick_taken(c->backing_db, name->valuestring)) return error_response("Nickname already taken");
-	logr("User %s set their username to %s\n", user_id->valuestring, name->valuestring);
-	strncpy(user->user_name, name->valuestring, sizeof(user->user_name) - 1);
+	struct db_job *job = db_job_for(connection, DB_SET_NAME);
+	memcpy(job->uuid, user->uuid, sizeof(job->uuid));
+	strncpy(job->name, name->valuestring, sizeof(job->name) - 1);
+	queue_db_job(c, job);
 	user->last_event_unix = (unsigned)time(NULL);
-	return base_response("nameSetSuccess");
+	return NULL;
 }
 
 cJSON *broadcast_announcement(struct canvas *c, const char *message) {
@@ -696,29 +1636,36 @@ cJSON *broadcast_announcement(struct canvas *c, const char *message) {
 	return base_response("Success");
 }
 
-void kick_with_message(struct canvas *c, const struct user *user, const char *message, const char *reconnect_btn_text) {
+// then, if not NULL, is queued for the db thread once user is dropped and its save queued.
+// A user of another reactor is only posted the kick, with users_lock held.
+void kick_with_message(struct canvas *c, struct user *user, const char *message, const char *reconnect_btn_text, struct db_job *then) {
 	cJSON *response = base_response("kicked");
 	cJSON_AddStringToObject(response, "message", message ? message : "Kicked");
 	cJSON_AddStringToObject(response, "btn_text", reconnect_btn_text ? reconnect_btn_text : "Reconnect");
-	send_json(response, user);
+	struct reactor *owner = conn_reactor(user->socket);
+	if (owner == t_reactor) {
+		send_json(response, user);
+		drop_user_with_connection(c, user->socket);
+		if (then) queue_db_job(c, then);
+	} else {
+		// Connection belongs to another reactor, it does the actual drop
+		char *str = cJSON_PrintUnformatted(response);
+		if (str) post_kick(owner, user->socket->id, str, then);
+		else if (then) queue_db_job(c, then);
+		free(str);
+	}
 	cJSON_Delete(response);
-	drop_user_with_connection(c, user->socket);
 }
 
+// Once the reactors are stopped
 void drop_all_connections(struct canvas *c) {
-	list_foreach(c->connected_users, {
-		struct user *user = (struct user *)arg;
-		user->last_connected_unix = (unsigned)time(NULL);
-		c->connected_user_count--;
-		save_user(c, user);
-		mg_timer_free(&c->mgr.timers, user->tile_increment_timer);
-		user->socket->is_draining = 1;
-		list_remove(c->connected_users, {
-			const struct user *list_user = (struct user *)arg;
-			return list_user->socket == user->socket;
-		});
-		send_user_count(c);
-	});
+	for (size_t i = 0; i < c->reactor_count; ++i) {
+		struct reactor *r = &c->reactors[i];
+		while (r->sockets.first) {
+			drop_user(c, ilist_entry(r->sockets.first, struct user, reactor_node));
+			send_user_count(c);
+		}
+	}
 }
 
 cJSON *shut_down_server(void) {
@@ -726,23 +1673,17 @@ cJSON *shut_down_server(void) {
 	return NULL;
 }
 
-cJSON *shadow_ban_user(struct canvas *c, const char *uuid, bool toggle) {
-	bool free_user = false;
-	struct user *user = find_in_connected_users(c, uuid);
-	if (!user) {
-		user = try_load_user(c, uuid);
-		free_user = true;
-	}
-	if (!user) return error_response("No user found with that uuid");
-	bool banned = toggle ? !user->is_shadow_banned : true;
-	logr("Setting is_shadow_banned to %s for user %s\n", banned ? "true" : "false", uuid);
-	user->is_shadow_banned = banned;
-	save_user(c, user);
-	if (free_user) free(user);
-	return base_response("Success");
+// Done by the db thread, which tells the reactor of the user if it's connected, see MAIL_SHADOW_BAN
+cJSON *shadow_ban_user(struct canvas *c, struct mg_connection *connection, const cJSON *uuid) {
+	if (!cJSON_IsString(uuid) || strlen(uuid->valuestring) > UUID_STR_LEN) return error_response("No user found with that uuid");
+	struct db_job *job = db_job_for(connection, DB_SHADOW_BAN);
+	strncpy(job->uuid, uuid->valuestring, UUID_STR_LEN);
+	job->ban.toggle = true;
+	queue_db_job(c, job);
+	return NULL;
 }
 
-cJSON *handle_ban_click(struct canvas *c, const cJSON *coordinates) {
+cJSON *handle_ban_click(struct canvas *c, struct mg_connection *connection, const cJSON *coordinates) {
 	if (!cJSON_IsArray(coordinates)) return error_response("No valid coordinates provided");
 	if (cJSON_GetArraySize(coordinates) < 2) return error_response("No valid coordinates provided");
 	cJSON *x_param = cJSON_GetArrayItem(coordinates, 0);
@@ -756,20 +1697,17 @@ cJSON *handle_ban_click(struct canvas *c, const cJSON *coordinates) {
 	if (x > c->edge_length - 1) return error_response("Invalid X coordinate");
 	if (y > c->edge_length - 1) return error_response("Invalid Y coordinate");
 
-	struct tile *tile = &c->tiles[x + y * c->edge_length];
+	char last_modifier[UUID_STR_LEN + 1];
+	uuid_for_id(c, __atomic_load_n(&c->tile_modifiers[x + y * c->edge_length], __ATOMIC_RELAXED), last_modifier);
 	// Just in case...
-	struct administrator *admin = find_in_admins(c, tile->last_modifier);
-	if (admin) return error_response("Refusing to shadowban an administrator");
-
-	struct user *user = find_in_connected_users(c, tile->last_modifier);
-	if (!user) user = try_load_user(c, tile->last_modifier);
-	if (!user) return error_response("Couldn't find a user who modified that tile.");
-	if (user->is_shadow_banned) return error_response("Already shadowbanned from there");
-	logr("User %s shadowbanned from (%4lu,%4lu)\n", user->uuid, x, y);
-	user->is_shadow_banned = true;
-	save_user(c, user);
+	if (find_in_admins(c, last_modifier, NULL)) return error_response("Refusing to shadowban an administrator");
 
-	return base_response("ban_click_success");
+	struct db_job *job = db_job_for(connection, DB_SHADOW_BAN);
+	memcpy(job->uuid, last_modifier, sizeof(job->uuid));
+	job->ban.x = x;
+	job->ban.y = y;
+	queue_db_job(c, job);
+	return NULL;
 }
 
 static void admin_place_tile(struct canvas *c, int x, int y, uint8_t color_id, const char *uuid) {
@@ -778,31 +1716,13 @@ static void admin_place_tile(struct canvas *c, int x, int y, uint8_t color_id, c
 	if (x < 0) return;
 	if (y < 0) return;
 
-	struct tile *tile = &c->tiles[x + y * c->edge_length];
-	if (tile->color_id == color_id) return;
-	tile->color_id = color_id;
-	tile->place_time_unix = (unsigned)time(NULL);
-	memcpy(tile->last_modifier, uuid, sizeof(tile->last_modifier));
+	size_t i = x + y * c->edge_length;
+	if (c->tile_colors[i] == color_id) return;
 
 	// This print is for compatibility with https://github.com/zouppen/pikselipeli-parser
 	logr("Received request: {\"requestType\":\"postTile\",\"userID\":\"%s\",\"X\":%i,\"Y\":%i,\"colorID\":\"%u\"}\n", uuid, x, y, color_id);
 
-	// Record delta for persistence. These get flushed to disk every canvas_save_interval_sec seconds.
-	struct tile_placement placement = {
-		.x = x,
-		.y = y,
-		.tile = *tile
-	};
-	list_append(c->delta, placement);
-
-	c->dirty = true;
-
-	struct tile_update response = {
-		.resp_type = RES_TILE_UPDATE,
-		.color_id = color_id,
-		.i = htonl(x + y * c->edge_length),
-	};
-	bin_broadcast(c, (const char *)&response, sizeof(response));
+	set_tile(c, i, color_id, (unsigned)time(NULL), intern_uuid(c, uuid));
 }
 
 cJSON *handle_admin_brush(struct canvas *c, const cJSON *coordinates, const cJSON *colorID, const char *uuid) {
@@ -818,7 +1738,7 @@ cJSON *handle_admin_brush(struct canvas *c, const cJSON *coordinates, const cJSO
 	size_t x = x_param->valueint;
 	size_t y = y_param->valueint;
 
-	if (color_id > c->color_list.amount - 1) return error_response("Invalid colorID");
+	if (color_id > __atomic_load_n(&c->color_list.amount, __ATOMIC_RELAXED) - 1) return error_response("Invalid colorID");
 
 	for (int diffX = -3; diffX < 4; ++diffX) {
 		for (int diffY = -3; diffY < 4; ++diffY) {
@@ -829,10 +1749,10 @@ cJSON *handle_admin_brush(struct canvas *c, const cJSON *coordinates, const cJSO
 	return NULL;
 }
 
-cJSON *handle_admin_command(struct canvas *c, const cJSON *user_id, const cJSON *command) {
+cJSON *handle_admin_command(struct canvas *c, struct mg_connection *connection, const cJSON *user_id, const cJSON *command) {
 	if (!cJSON_IsString(user_id)) return error_response("No valid userID provided");
-	struct administrator *admin = find_in_admins(c, user_id->valuestring);
-	if (!admin) {
+	struct administrator admin;
+	if (!find_in_admins(c, user_id->valuestring, &admin)) {
 		logr("Rejecting admin command for unknown user %s. Naughty naughty!\n", user_id->valuestring);
 		return error_response("Invalid admin userID");	
 	}
@@ -843,160 +1763,159 @@ cJSON *handle_admin_command(struct canvas *c, const cJSON *user_id, const cJSON
 	const cJSON *colorID = cJSON_GetObjectItem(command, "colorID");
 	if (!cJSON_IsString(action)) return error_response("Invalid command action");
 	if (str_eq(action->valuestring, "shutdown")) {
-		if (admin->can_shutdown) {
+		if (admin.can_shutdown) {
 			return shut_down_server();
 		} else {
 			return error_response("You don't have shutdown permission");
 		}
 	}
 	if (str_eq(action->valuestring, "message")) {
-		if (admin->can_announce) {
+		if (admin.can_announce) {
 			return broadcast_announcement(c, message->valuestring);
 		} else {
 			return error_response("You don't have announce permission");
 		}
 	}
 	if (str_eq(action->valuestring, "toggle_shadowban")) {
-		if (admin->can_shadowban) {
-			return shadow_ban_user(c, message->valuestring, true);
+		if (admin.can_shadowban) {
+			return shadow_ban_user(c, connection, message);
 		} else {
 			return error_response("You don't have shadowban permission");
 		}
 	}
 	if (str_eq(action->valuestring, "banclick")) {
-		if (admin->can_banclick) {
-			return handle_ban_click(c, coordinates);
+		if (admin.can_banclick) {
+			return handle_ban_click(c, connection, coordinates);
 		} else {
 			return error_response("You don't have banclick permission");
 		}
 	}
 	if (str_eq(action->valuestring, "brush")) {
-		return handle_admin_brush(c, coordinates, colorID, admin->uuid);
+		return handle_admin_brush(c, coordinates, colorID, admin.uuid);
 	}
 	return error_response("Unknown admin action invoked");
 }
 
-cJSON *handle_auth(struct canvas *c, const cJSON *user_id, struct mg_connection *socket) {
+// Pick the first of the codecs the client listed that we have. Clients that list some we don't have get
+// CODEC_DEFAULT. Clients that don't send a list at all predate chunks, and keep getting RES_CANVAS.
+void parse_codecs(const cJSON *codec_names, bool *legacy_canvas, enum codec_id *codec) {
+	*legacy_canvas = !cJSON_IsArray(codec_names);
+	*codec = CODEC_DEFAULT;
+	const cJSON *name = NULL;
+	cJSON_ArrayForEach(name, codec_names) {
+		if (!cJSON_IsString(name)) continue;
+		enum codec_id found = codec_by_name(name->valuestring);
+		if (found == CODEC_COUNT) continue;
+		*codec = found;
+		break;
+	}
+}
+
+// Holds back whatever connection sends until the db thread is done authenticating it, see finish_auth()
+static void start_auth(struct mg_connection *connection) {
+	struct reactor *r = conn_reactor(connection);
+	mg_iobuf_add(&r->authing, r->authing.len, &connection->id, sizeof(connection->id), MG_IO_SIZE);
+}
+
+// The user is loaded by the db thread, and connected once it's back, see finish_auth()
+cJSON *handle_auth(struct canvas *c, const cJSON *user_id, struct mg_connection *socket, const cJSON *codec_names) {
 	if (!cJSON_IsString(user_id)) return error_response("Invalid userID");
 	if (strlen(user_id->valuestring) > UUID_STR_LEN) return error_response("Invalid userID");
+	if (socket->fn_data) return error_response("Already authenticated");
+
+	struct db_job *job = db_job_for(socket, DB_AUTH);
+	strncpy(job->uuid, user_id->valuestring, UUID_STR_LEN);
+	parse_codecs(codec_names, &job->auth.legacy_canvas, &job->auth.codec);
+	start_auth(socket);
 
 	// Kick old user if the user opens in more than one browser tab at once.
+	// It gets loaded once the old one is saved.
+	pthread_rwlock_rdlock(&c->users_lock);
 	struct user *user = find_in_connected_users(c, user_id->valuestring);
+	bool is_remote = user && conn_reactor(user->socket) != t_reactor;
+	if (user) logr("Kicking %s, they opened a new session\n", user->uuid);
+	if (is_remote) kick_with_message(c, user, "It looks like you opened another tab?", "Reconnect here", job);
+	pthread_rwlock_unlock(&c->users_lock);
+	// Ours can't go anywhere in the meantime, it's dropped without users_lock held
+	if (is_remote) return NULL;
 	if (user) {
-		logr("Kicking %s, they opened a new session\n", user->uuid);
-		kick_with_message(c, user, "It looks like you opened another tab?", "Reconnect here");
+		kick_with_message(c, user, "It looks like you opened another tab?", "Reconnect here", job);
+	} else {
+		queue_db_job(c, job);
 	}
+	return NULL;
+}
 
-	user = try_load_user(c, user_id->valuestring);
-	if (!user) return error_response("Invalid userID");
-	struct user *uptr = list_append(c->connected_users, *user)->thing;
-	free(user);
-	uptr->socket = socket;
+// Host accounting and making the user is up to the db thread, see finish_auth()
+cJSON *handle_initial_auth(struct canvas *c, struct mg_connection *socket, const cJSON *codec_names) {
+	if (socket->fn_data) return error_response("Already authenticated");
+	struct db_job *job = db_job_for(socket, DB_INITIAL_AUTH);
+	job->auth.has_addr = extract_addr(socket, &job->auth.addr);
+	parse_codecs(codec_names, &job->auth.legacy_canvas, &job->auth.codec);
+	start_auth(socket);
+	queue_db_job(c, job);
+	return NULL;
+}
 
-	c->connected_user_count++;
-	if (c->connected_user_count > c->settings.max_concurrent_users) {
-		logr("Kicking %s. Server full. (Sad!)\n", uptr->uuid);
-		kick_with_message(c, uptr, "Sorry, the server is full :(\n Try again later!", "Try again");
-		return NULL;
-	}
+// Connects the user the db thread loaded or made for socket, and tells the client
+cJSON *finish_auth(struct canvas *c, struct mg_connection *socket, const struct auth_reply *reply) {
+	if (reply->error) return error_response((char *)reply->error);
 
+	// Kicks another session of it, if that got in while this one was loading
+	struct user *uptr = connect_user(c, &reply->user, socket, reply->legacy_canvas, reply->codec);
 	assign_rate_limiter_limit(&uptr->canvas_limiter, &c->settings.getcanvas_max_rate, &c->settings.getcanvas_per_seconds);
 	assign_rate_limiter_limit(&uptr->tile_limiter, &c->settings.setpixel_max_rate, &c->settings.setpixel_per_seconds);
-	// Kinda pointless flag. If this thing is in connected_users list, it's valid.
-	uptr->is_authenticated = true;
-
-	logr("User %s connected. (%4lu)\n", uptr->uuid, c->connected_user_count);
-	start_user_timer(uptr, socket->mgr);
-	send_user_count(c);
-
 	uint64_t cur_time = (unsigned)time(NULL);
-	size_t sec_since_last_connected = cur_time - uptr->last_connected_unix;
-	size_t tiles_to_add = sec_since_last_connected / uptr->tile_regen_seconds;
-	// This is how it was in the original, might want to check
-	uptr->remaining_tiles += tiles_to_add > uptr->max_tiles ? uptr->max_tiles - uptr->remaining_tiles : tiles_to_add;
-	uptr->last_event_unix = cur_time;
-
-	cJSON *response = base_response("reAuthSuccessful");
-	cJSON_AddNumberToObject(response, "remainingTiles", uptr->remaining_tiles);
-	cJSON_AddNumberToObject(response, "level", uptr->level);
-	cJSON_AddNumberToObject(response, "maxTiles", uptr->max_tiles);
-	cJSON_AddNumberToObject(response, "tilesToNextLevel", uptr->tiles_to_next_level);
-	cJSON_AddNumberToObject(response, "levelProgress", uptr->current_level_progress);
-	struct administrator *admin = find_in_admins(c, uptr->uuid);
-	bool tile_info_available = false;
-	if (admin) {
-		cJSON_AddBoolToObject(response, "showBanBtn", admin->can_banclick);
-		cJSON_AddBoolToObject(response, "showCleanupBtn", admin->can_cleanup);
-		tile_info_available = true;
-	}
-	cJSON_AddBoolToObject(response, "tileInfoAvailable", tile_info_available);
-	return response;
-}
-
-cJSON *handle_initial_auth(struct canvas *c, struct mg_connection *socket, struct remote_host *host) {
-	if (host) {
-		logr("Received initialAuth from %s\n", socket->label);
-		host->total_accounts++;
-		save_host(c, host);
-		if (host->total_accounts > c->settings.max_users_per_ip) {
-			char ip_buf[50];
-			mg_ntoa(&host->addr, ip_buf, sizeof(ip_buf));
-			logr("Rejecting initialAuth from %s, reached maximum of %li users\n", ip_buf, c->settings.max_users_per_ip);
-			return error_response("Maximum users reached for this IP (contact vkoskiv if you think this is an issue)");
-		}
+	if (reply->is_new) {
+		uptr->canvas_limiter.current_allowance = c->settings.getcanvas_max_rate;
+		uptr->tile_limiter.current_allowance = c->settings.setpixel_max_rate;
+		gettimeofday(&uptr->tile_limiter.last_event_time, NULL);
+		gettimeofday(&uptr->canvas_limiter.last_event_time, NULL);
 	} else {
-		logr("Warning: No host given to handle_initial_auth. Maybe fix this probably.\n");
+		// Credit the time spent offline, reAuthSuccessful carries the new count
+		uptr->last_regen_unix = uptr->last_connected_unix;
+		regen_tiles(uptr, cur_time);
+		uptr->unsent_tiles = 0;
 	}
 
-	struct user user = {
-		.user_name = "Anonymous",
-		.socket = socket,
-		.is_authenticated = true,
-		.remaining_tiles = 60,
-		.max_tiles = 250,
-		.tile_regen_seconds = 10,
-		.total_tiles_placed = 0,
-		.tiles_to_next_level = 100,
-		.current_level_progress = 0,
-		.level = 1,
-		.last_connected_unix = 0,
-	};
-	generate_uuid(user.uuid);
-	struct user *uptr = list_append(c->connected_users, user)->thing;
-	add_user(c, uptr);
-	uptr->socket = socket;
-
-	// Set up rate limiting
-	assign_rate_limiter_limit(&uptr->canvas_limiter, &c->settings.getcanvas_max_rate, &c->settings.getcanvas_per_seconds);
-	assign_rate_limiter_limit(&uptr->tile_limiter, &c->settings.setpixel_max_rate, &c->settings.setpixel_per_seconds);
-	uptr->canvas_limiter.current_allowance = c->settings.getcanvas_max_rate;
-	uptr->tile_limiter.current_allowance = c->settings.setpixel_max_rate;
-	gettimeofday(&uptr->tile_limiter.last_event_time, NULL);
-	gettimeofday(&uptr->canvas_limiter.last_event_time, NULL);
-
-	c->connected_user_count++;
-	if (c->connected_user_count > c->settings.max_concurrent_users) {
+	size_t user_count = __atomic_add_fetch(&c->connected_user_count, 1, __ATOMIC_RELAXED);
+	if (user_count > c->settings.max_concurrent_users) {
 		logr("Kicking %s. Server full. (Sad!)\n", uptr->uuid);
-		kick_with_message(c, uptr, "Sorry, the server is full :(", "Try again");
+		kick_with_message(c, uptr, reply->is_new ? "Sorry, the server is full :(" : "Sorry, the server is full :(\n Try again later!", "Try again", NULL);
 		return NULL;
 	}
 
-	logr("User %s connected. (%4lu)\n", uptr->uuid, c->connected_user_count);
-	start_user_timer(uptr, socket->mgr);
+	logr("User %s connected. (%4lu)\n", uptr->uuid, user_count);
+	start_user_timers(uptr);
 	send_user_count(c);
+	uptr->last_event_unix = cur_time;
 
-	uptr->last_event_unix = (unsigned)time(NULL);
-
-	cJSON *response = base_response("authSuccessful");
-	cJSON_AddStringToObject(response, "uuid", uptr->uuid);
+	cJSON *response = base_response(reply->is_new ? "authSuccessful" : "reAuthSuccessful");
+	if (reply->is_new) cJSON_AddStringToObject(response, "uuid", uptr->uuid);
 	cJSON_AddNumberToObject(response, "remainingTiles", uptr->remaining_tiles);
 	cJSON_AddNumberToObject(response, "level", uptr->level);
 	cJSON_AddNumberToObject(response, "maxTiles", uptr->max_tiles);
 	cJSON_AddNumberToObject(response, "tilesToNextLevel", uptr->tiles_to_next_level);
 	cJSON_AddNumberToObject(response, "levelProgress", uptr->current_level_progress);
+	if (!reply->is_new) {
+		struct administrator admin;
+		bool tile_info_available = false;
+		if (find_in_admins(c, uptr->uuid, &admin)) {
+			cJSON_AddBoolToObject(response, "showBanBtn", admin.can_banclick);
+			cJSON_AddBoolToObject(response, "showCleanupBtn", admin.can_cleanup);
+			tile_info_available = true;
+		}
+		cJSON_AddBoolToObject(response, "tileInfoAvailable", tile_info_available);
+	}
+	// Tell clients that listed codecs which one they got
+	if (!uptr->legacy_canvas) cJSON_AddStringToObject(response, "codec", codecs[uptr->codec].name);
 	return response;
 }
 
+static const char *canvas_format_name(size_t format) {
+	return format == CANVAS_FORMAT_LEGACY ? "legacy zlib" : codecs[format].name;
+}
+
 cJSON *handle_command(struct canvas *c, const char *cmd, size_t len, struct mg_connection *connection) {
 	// cmd is not necessarily null-terminated. Trust len.
 	cJSON *command = cJSON_ParseWithLength(cmd, len);
@@ -1009,20 +1928,20 @@ cJSON *handle_command(struct canvas *c, const char *cmd, size_t len, struct mg_c
 	const cJSON *x         = cJSON_GetObjectItem(command, "X");
 	const cJSON *y         = cJSON_GetObjectItem(command, "Y");
 	const cJSON *admin_cmd = cJSON_GetObjectItem(command, "cmd");
+	const cJSON *codec_names = cJSON_GetObjectItem(command, "codecs");
 	char *reqstr = request_type->valuestring;
 
 	cJSON *response = NULL;
 	if (str_eq(reqstr, "initialAuth")) {
-		struct remote_host *host = extract_host(c, connection);
-		response = handle_initial_auth(c, connection, host);
+		response = handle_initial_auth(c, connection, codec_names);
 	} else if (str_eq(reqstr, "auth")) {
-		response = handle_auth(c, user_id, connection);
+		response = handle_auth(c, user_id, connection, codec_names);
 	} else if (str_eq(reqstr, "gti")) {
-		response = handle_get_tile_info(c, user_id, x, y);
+		response = handle_get_tile_info(c, connection, user_id, x, y);
 	} else if (str_eq(reqstr, "setUsername")) {
-		response = handle_set_nickname(c, user_id, name);
+		response = handle_set_nickname(c, connection, user_id, name);
 	} else if (str_eq(reqstr, "admin_cmd")) {
-		response = handle_admin_command(c, user_id, admin_cmd);
+		response = handle_admin_command(c, connection, user_id, admin_cmd);
 	} else {
 		response = error_response("Unknown requestType");
 	}
@@ -1043,6 +1962,9 @@ enum request_type {
 	REQ_POST_TILE,
 	REQ_GET_COLORS,
 	REQ_SET_USERNAME,
+	REQ_GET_UPDATES,
+	REQ_GET_REGION,
+	REQ_SUBSCRIBE,
 };
 
 char *ack(enum response_id e) {
@@ -1061,12 +1983,15 @@ struct user_count {
 	uint16_t count;
 };
 
-void send_user_count(const struct canvas *c) {
+// Counted under broadcast_lock, so whatever count goes out last is the latest one
+void send_user_count(struct canvas *c) {
+	pthread_mutex_lock(&c->broadcast_lock);
 	struct user_count resp = {
 		.type = RES_USER_COUNT,
-		.count = htons(c->connected_user_count),
+		.count = htons(__atomic_load_n(&c->connected_user_count, __ATOMIC_RELAXED)),
 	};
-	bin_broadcast(c, (const char *)&resp, sizeof(resp));
+	post_broadcast_locked(c, MAIL_BROADCAST, (const char *)&resp, sizeof(resp), WEBSOCKET_OP_BINARY);
+	pthread_mutex_unlock(&c->broadcast_lock);
 }
 
 struct request {
@@ -1077,10 +2002,28 @@ struct request {
 	union {
 		uint16_t color_id;
 		uint16_t data_len;
+		uint16_t width;
 	};
+	uint16_t height;
+	uint8_t level; // Of the canvas, see CANVAS_LEVELS
 	char data[];
 };
 
+// After auth the connection already knows its user, so requests can leave the uuid out.
+// These are flagged with REQ_SESSION, and trailing fields a request doesn't use can be left out too.
+#define REQ_SESSION 0x80
+struct session_request {
+	uint8_t request_type;
+	uint8_t level;
+	uint16_t x;
+	uint16_t y;
+	union {
+		uint16_t color_id;
+		uint16_t width;
+	};
+	uint16_t height;
+};
+
 char *handle_req_auth(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
 	(void)req;
 	(void)c;
@@ -1092,8 +2035,8 @@ char *handle_req_auth(struct canvas *c, const struct request *req, struct mg_con
 }
 
 char *handle_req_get_canvas(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
-	(void)connection;
-	struct user *user = find_in_connected_users(c, req->uuid);
+	(void)req;
+	struct user *user = conn_user(connection);
 	if (!user) return error(ERR_INVALID_UUID);
 
 	bool within_limit = is_within_rate_limit(&user->canvas_limiter);
@@ -1107,29 +2050,150 @@ char *handle_req_get_canvas(struct canvas *c, const struct request *req, struct
 	struct timeval tmr;
 	gettimeofday(&tmr, NULL);
 
-	// nab a copy of the data, avoid blocking updates for others.
-	uint8_t *copy;
-	size_t copy_len;
-	float copy_ratio;
-	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
-	pthread_mutex_lock(&c->canvas_cache_lock);
-	copy_len = c->canvas_cache_len;
-	copy_ratio = c->canvas_cache_compression_ratio;
-	copy = malloc(copy_len + 1);
-	memcpy(copy + 1, c->canvas_cache, copy_len);
-	pthread_mutex_unlock(&c->canvas_cache_lock);
-	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
-	copy[0] = RES_CANVAS;
+	// nab a reference to the current frame, the worker swaps in a new one instead of touching it.
+	size_t format = canvas_format(user);
+	const struct canvas_cache *cache = &c->canvas_caches[format];
+	struct mg_shared *catch_up;
+	struct mg_shared *frame = frame_with_catch_up(conn_reactor(connection), format, &catch_up);
+	// First one to ask for this format in a while, or it's too far behind. The worker builds
+	// a new one, and resync_timer_fn() sends it.
+	if (!frame) {
+		if (!user->needs_resync) {
+			user->needs_resync = true;
+			conn_reactor(connection)->resyncs_pending++;
+		}
+		want_canvas_cache(c);
+		return NULL;
+	}
 	long ms = get_ms_delta(tmr);
 	char buf[64];
-	human_file_size(copy_len, buf);
-	logr("Sending zlib'd canvas to %s. (%.2f%%, %s, %lums)\n", user->uuid, copy_ratio, buf, ms);
-	mg_ws_send(user->socket, (char *)copy, copy_len + 1, WEBSOCKET_OP_BINARY);
-	free(copy);
+	pthread_mutex_lock(&c->canvas_cache_lock);
+	human_file_size(cache->len, buf);
+	float ratio = cache->compression_ratio;
+	pthread_mutex_unlock(&c->canvas_cache_lock);
+	logr("Sending %s canvas to %s. (%.2f%%, %s, %lums)\n", canvas_format_name(format), user->uuid, ratio, buf, ms);
+	// Streamed straight from the shared frame, and not deflated since it's already compressed
+	mg_send_shared(user->socket, frame);
+	if (catch_up) mg_send_shared(user->socket, catch_up);
+	mg_shared_unref(frame);
+	mg_shared_unref(catch_up);
+	if (response_len) *response_len = 0;
+	return NULL;
+}
+
+// The tile updates sent after the last one the client saw, or the whole canvas if we don't have them all anymore.
+// The sequence number takes the place of x and y, as a u32 in network byte order.
+char *handle_req_get_updates(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
+	struct user *user = conn_user(connection);
+	if (!user) return error(ERR_INVALID_UUID);
+
+	uint32_t last_seen = (uint32_t)req->x << 16 | req->y;
+	pthread_mutex_lock(&c->broadcast_lock);
+	// Also huge if last_seen is from before a restart, and ahead of us
+	uint32_t missed = c->update_seq - 1 - last_seen;
+	if (missed > c->update_history_len) {
+		pthread_mutex_unlock(&c->broadcast_lock);
+		logr("%s missed more tile updates than we have, sending the canvas\n", user->uuid);
+		return handle_req_get_canvas(c, req, connection, response_len);
+	}
+	if (!is_within_rate_limit(&user->canvas_limiter)) {
+		pthread_mutex_unlock(&c->broadcast_lock);
+		logr("%s exceeded canvas rate limit\n", user->uuid);
+		return error(ERR_RATE_LIMIT_EXCEEDED);
+	}
+	user->last_event_unix = (unsigned)time(NULL);
+
+	// Updates already in the mailbox may arrive after these, clients skip what they've seen
+	char *response = (char *)tile_updates_since(c, last_seen + 1, missed, response_len);
+	pthread_mutex_unlock(&c->broadcast_lock);
+	logr("Sending %u missed tile updates to %s\n", missed, user->uuid);
+	return response;
+}
+
+// The chunks of level covering the rectangle of canvas tiles in req, clipped to the canvas.
+// The rectangle must not be empty, and has to start on the canvas.
+static struct chunk_rect covering_chunks(const struct canvas *c, const struct request *req, size_t level) {
+	size_t scale = 1 << level;
+	size_t x1 = (size_t)req->x + req->width > c->edge_length ? c->edge_length : (size_t)req->x + req->width;
+	size_t y1 = (size_t)req->y + req->height > c->edge_length ? c->edge_length : (size_t)req->y + req->height;
+	x1 = (x1 + scale - 1) / scale;
+	y1 = (y1 + scale - 1) / scale;
+	struct chunk_rect rect = {
+		.x = req->x / scale / CANVAS_CHUNK_EDGE,
+		.y = req->y / scale / CANVAS_CHUNK_EDGE,
+	};
+	rect.width = (x1 - 1) / CANVAS_CHUNK_EDGE + 1 - rect.x;
+	rect.height = (y1 - 1) / CANVAS_CHUNK_EDGE + 1 - rect.y;
+	return rect;
+}
+
+// The chunks covering the x, y, width, height rectangle of tiles, for clients that only load what they show.
+// Zoomed out, they can ask for it from a scaled down level. The rectangle is in tiles of the canvas either way.
+// Charged against the canvas rate limit by how much of the canvas it would take to send the same number of chunks.
+// Only what's needed is taken here, it gets compressed and sent by send_pending_region() once this returns.
+char *handle_req_get_region(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
+	struct user *user = conn_user(connection);
+	if (!user) return error(ERR_INVALID_UUID);
+	if (!req->width || !req->height || req->x >= c->edge_length || req->y >= c->edge_length) return NULL;
+	if (req->level >= CANVAS_LEVELS) return NULL;
+
+	struct chunk_rect rect = covering_chunks(c, req, req->level);
+	float share = (float)(rect.width * rect.height) / ((float)c->levels[0].chunks_per_edge * c->levels[0].chunks_per_edge);
+	if (!is_within_rate_limit_cost(&user->canvas_limiter, share)) {
+		logr("%s exceeded canvas rate limit\n", user->uuid);
+		return error(ERR_RATE_LIMIT_EXCEEDED);
+	}
+	user->last_event_unix = (unsigned)time(NULL);
+
+	// Have the worker keep this level fresh in this codec from here on
+	uint32_t codec_bit = 1U << user->codec;
+	if (req->level && !(__atomic_fetch_or(&c->region_codecs[req->level], codec_bit, __ATOMIC_RELAXED) & codec_bit)) {
+		want_canvas_cache(c);
+	}
+
+	struct reactor *r = conn_reactor(connection);
+	r->pending_region = malloc(sizeof(*r->pending_region));
+	*r->pending_region = (struct region_reply){ .level = req->level, .codec = user->codec, .rect = rect };
+	take_region(c, r->pending_region);
 	if (response_len) *response_len = 0;
 	return NULL;
 }
 
+// Needs no locks. Finishes the region handle_req_get_region() took, if there's one, and sends it.
+// It's already compressed, so it goes out without deflate.
+static void send_pending_region(struct reactor *r, struct mg_connection *connection) {
+	if (!r->pending_region) return;
+	size_t len = 0;
+	uint8_t *message = finish_region(r->pending_region, &len);
+	free(r->pending_region);
+	r->pending_region = NULL;
+	mg_ws_send(connection, (const char *)message, len, WEBSOCKET_OP_BINARY | WEBSOCKET_NO_DEFLATE);
+	free(message);
+}
+
+// Only send tile updates for the chunks covering the x, y, width, height rectangle of tiles from here on,
+// for clients that only show part of the canvas. An empty rectangle goes back to getting all of them.
+// So does one covering half the canvas or more, the unfiltered updates are cheaper to send than to filter.
+char *handle_req_subscribe(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
+	(void)response_len;
+	struct user *user = conn_user(connection);
+	if (!user) return error(ERR_INVALID_UUID);
+	if (!is_within_rate_limit(&user->subscribe_limiter)) {
+		logr("%s exceeded subscribe rate limit\n", user->uuid);
+		return error(ERR_RATE_LIMIT_EXCEEDED);
+	}
+	if (!req->width || !req->height) {
+		reactor_subscribe(user, NULL);
+		return NULL;
+	}
+	if (req->x >= c->edge_length || req->y >= c->edge_length) return NULL;
+
+	struct chunk_rect rect = covering_chunks(c, req, 0);
+	size_t chunk_count = (size_t)c->levels[0].chunks_per_edge * c->levels[0].chunks_per_edge;
+	reactor_subscribe(user, 2 * (size_t)rect.width * rect.height >= chunk_count ? NULL : &rect);
+	return NULL;
+}
+
 char *handle_req_get_tile_info(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
 	//TODO
 	(void)req;
@@ -1149,10 +2213,10 @@ void dump_req(const struct request *req) {
 }
 
 char *handle_req_post_tile(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
-	(void)connection;
-	struct user *user = find_in_connected_users(c, req->uuid);
+	struct user *user = conn_user(connection);
 
 	if (!user) return error(ERR_INVALID_UUID);
+	regen_tiles(user, (unsigned)time(NULL));
 	if (user->remaining_tiles < 1) return NULL;
 
 	if (!is_within_rate_limit(&user->tile_limiter)) {
@@ -1165,7 +2229,7 @@ char *handle_req_post_tile(struct canvas *c, const struct request *req, struct m
 
 	if (x > c->edge_length - 1) return NULL;
 	if (y > c->edge_length - 1) return NULL;
-	if (color_id > c->color_list.amount - 1) return NULL;
+	if (color_id > __atomic_load_n(&c->color_list.amount, __ATOMIC_RELAXED) - 1) return NULL;
 
 	user->remaining_tiles--;
 	user->total_tiles_placed++;
@@ -1189,39 +2253,24 @@ char *handle_req_post_tile(struct canvas *c, const struct request *req, struct m
 	// This print is for compatibility with https://github.com/zouppen/pikselipeli-parser
 	logr("Received request: {\"requestType\":\"postTile\",\"userID\":\"%s\",\"X\":%li,\"Y\":%li,\"colorID\":\"%u\"}\n", user->uuid, x, y, color_id);
 
-	struct tile *tile = &c->tiles[x + y * c->edge_length];
-	tile->color_id = color_id;
-	tile->place_time_unix = user->last_event_unix;
-	memcpy(tile->last_modifier, user->uuid, sizeof(tile->last_modifier));
-
-	// Record delta for persistence. These get flushed to disk every canvas_save_interval_sec seconds.
-	struct tile_placement placement = {
-		.x = x,
-		.y = y,
-		.tile = *tile
-	};
-	list_append(c->delta, placement);
-
-	c->dirty = true;
-
-	struct tile_update response = {
-		.resp_type = RES_TILE_UPDATE,
-		.color_id = color_id,
-		.i = htonl(x + y * c->edge_length),
-	};
-	bin_broadcast(c, (const char *)&response, sizeof(response));
+	if (!user->modifier_id) user->modifier_id = intern_uuid(c, user->uuid);
+	set_tile(c, x + y * c->edge_length, color_id, user->last_event_unix, user->modifier_id);
 	if (response_len) *response_len = 0;
-	return NULL; // The broadcast takes care of this
+	return NULL; // The next tile update flush takes care of this
 }
 
 char *handle_req_get_colors(struct canvas *c, const struct request *req, struct mg_connection *connection, size_t *response_len) {
-	(void)connection;
-	struct user *user = find_in_connected_users(c, req->uuid);
+	(void)req;
+	struct user *user = conn_user(connection);
 	if (!user) return error(ERR_INVALID_UUID);
 	user->last_event_unix = (unsigned)time(NULL);
-	mg_ws_send(user->socket, c->color_response_cache, c->color_response_cache_len, WEBSOCKET_OP_BINARY);
-	if (response_len) *response_len = 0;
-	return NULL;
+	// A copy, a reload can replace it once config_lock is released
+	pthread_mutex_lock(&c->config_lock);
+	char *response = malloc(c->color_response_cache_len);
+	memcpy(response, c->color_response_cache, c->color_response_cache_len);
+	*response_len = c->color_response_cache_len;
+	pthread_mutex_unlock(&c->config_lock);
+	return response;
 }
 
 char *handle_req_set_username(struct canvas *canvas, const struct request *req, struct mg_connection *c, size_t *response_len) {
@@ -1255,7 +2304,7 @@ char *handle_req_initial_auth(struct canvas *c, const struct request *req, struc
 	if (host) {
 		logr("Received initialAuth from %s\n", socket->label);
 		host->total_accounts++;
-		save_host(c, host);
+		host->dirty = true;
 		if (host->total_accounts > c->settings.max_users_per_ip) {
 			char ip_buf[50];
 			mg_ntoa(&host->addr, ip_buf, sizeof(ip_buf));
@@ -1269,7 +2318,6 @@ char *handle_req_initial_auth(struct canvas *c, const struct request *req, struc
 	struct user user = {
 		.user_name = "Anonymous",
 		.socket = socket,
-		.is_authenticated = true,
 		.remaining_tiles = 60,
 		.max_tiles = 250,
 		.tile_regen_seconds = 10,
@@ -1278,11 +2326,11 @@ char *handle_req_initial_auth(struct canvas *c, const struct request *req, struc
 		.current_level_progress = 0,
 		.level = 1,
 		.last_connected_unix = 0,
+		.last_regen_unix = (unsigned)time(NULL),
 	};
 	generate_uuid(user.uuid);
-	struct user *uptr = list_append(c->connected_users, user)->thing;
+	struct user *uptr = connect_user(c, &user, socket);
 	add_user(c, uptr);
-	uptr->socket = socket;
 
 	// Set up rate limiting
 	assign_rate_limiter_limit(&uptr->canvas_limiter, &c->settings.getcanvas_max_rate, &g_canvas.settings.getcanvas_per_seconds);
@@ -1300,7 +2348,7 @@ char *handle_req_initial_auth(struct canvas *c, const struct request *req, struc
 	}
 
 	logr("User %s connected. (%4lu)\n", uptr->uuid, c->connected_user_count);
-	start_user_timer(uptr, socket->mgr);
+	start_user_timers(uptr);
 	send_user_count(c);
 
 	uptr->last_event_unix = (unsigned)time(NULL);
@@ -1330,10 +2378,27 @@ char *handle_req_initial_auth(struct canvas *c, const struct request *req, struc
 
 char *handle_binary_command(struct canvas *c, const char *request, size_t len, struct mg_connection *connection, size_t *response_len) {
 	if (!request || !len) return NULL;
-	struct request *req = (struct request *)request;
-	req->x = ntohs(req->x);
-	req->y = ntohs(req->y);
-	req->color_id = ntohs(req->color_id);
+	struct request decoded = { 0 };
+	struct request *req = &decoded;
+	if ((uint8_t)request[0] & REQ_SESSION) {
+		struct session_request session_req = { 0 };
+		memcpy(&session_req, request, len < sizeof(session_req) ? len : sizeof(session_req));
+		req->request_type = session_req.request_type & ~REQ_SESSION;
+		req->x = ntohs(session_req.x);
+		req->y = ntohs(session_req.y);
+		req->color_id = ntohs(session_req.color_id);
+		req->height = ntohs(session_req.height);
+		req->level = session_req.level;
+	} else {
+		memcpy(req, request, len < sizeof(*req) ? len : sizeof(*req));
+		req->x = ntohs(req->x);
+		req->y = ntohs(req->y);
+		req->color_id = ntohs(req->color_id);
+		req->height = ntohs(req->height);
+		// Still carries a uuid, which has to match the user bound to this connection
+		const struct user *user = conn_user(connection);
+		if (user && strncmp(user->uuid, req->uuid, UUID_STR_LEN) != 0) return error(ERR_INVALID_UUID);
+	}
 
 	enum request_type type = (enum request_type)req->request_type;
 	switch (type) {
@@ -1343,10 +2408,11 @@ char *handle_binary_command(struct canvas *c, const char *request, size_t len, s
 		case REQ_POST_TILE:     return handle_req_post_tile(c, req, connection, response_len);
 		case REQ_GET_COLORS:    return handle_req_get_colors(c, req, connection, response_len);
 		case REQ_SET_USERNAME:  return handle_req_set_username(c, req, connection, response_len);
-		case REQ_INITIAL_AUTH: {
-			struct remote_host *host = extract_host(c, connection);
-			return handle_req_initial_auth(c, req, connection, response_len, host);
-		}
+		case REQ_GET_UPDATES:   return handle_req_get_updates(c, req, connection, response_len);
+		case REQ_GET_REGION:    return handle_req_get_region(c, req, connection, response_len);
+		case REQ_SUBSCRIBE:     return handle_req_subscribe(c, req, connection, response_len);
+		// Hosts belong to the db thread, this one will have to go through it too once it's done
+		case REQ_INITIAL_AUTH:  return handle_req_initial_auth(c, req, connection, response_len, NULL);
 	}
 	return NULL;
 }
@@ -1354,15 +2420,18 @@ char *handle_binary_command(struct canvas *c, const char *request, size_t len, s
 // end binary response handling
 
 void update_color_response_cache(struct canvas *c) {
-	if (c->color_response_cache) free(c->color_response_cache);
-	c->color_response_cache_len = 1 + c->color_list.amount * sizeof(struct color);
-	c->color_response_cache = malloc(c->color_response_cache_len);
-	char *ptr = c->color_response_cache;
+	size_t len = 1 + c->color_list.amount * sizeof(struct color);
+	char *ptr = malloc(len);
 	ptr[0] = RES_COLOR_LIST;
 	struct color *list = (struct color *)(ptr + 1);
 	for (size_t i = 0; i < c->color_list.amount; ++i) {
 		list[i] = c->color_list.colors[i];
 	}
+	pthread_mutex_lock(&c->config_lock);
+	free(c->color_response_cache);
+	c->color_response_cache = ptr;
+	c->color_response_cache_len = len;
+	pthread_mutex_unlock(&c->config_lock);
 }
 
 void do_db_backup(struct canvas *c) {
@@ -1405,10 +2474,12 @@ void load_config(struct canvas *c) {
 		logr("params.json not found, exiting.\n");
 		goto bail;
 	}
-	cJSON *config = cJSON_ParseWithLength(conf, file_bytes);
+	// Not cJSON_GetErrorPtr(), the reactors keep parsing requests during a reload
+	const char *parse_end = NULL;
+	cJSON *config = cJSON_ParseWithLengthOpts(conf, file_bytes, &parse_end, false);
 	if (!config) {
 		logr("Failed to load params.json contents, exiting.\n");
-		logr("Error before: %s\n", cJSON_GetErrorPtr());
+		logr("Error before: %s\n", parse_end);
 		goto bail;
 	}
 	const cJSON *canvas_size = cJSON_GetObjectItem(config, "new_db_canvas_size");
@@ -1466,6 +2537,70 @@ void load_config(struct canvas *c) {
 		logr("max_concurrent_users not a number, exiting.\n");
 		goto bail;
 	}
+	// Optional, defaults to a single event loop thread
+	const cJSON *reactor_threads = cJSON_GetObjectItem(config, "reactor_threads");
+	if (reactor_threads && (!cJSON_IsNumber(reactor_threads) || reactor_threads->valueint < 1)) {
+		logr("reactor_threads not a positive number, exiting.\n");
+		goto bail;
+	}
+	// Optional, permessage-deflate is off unless asked for
+	const cJSON *ws_deflate = cJSON_GetObjectItem(config, "ws_deflate");
+	if (ws_deflate && !cJSON_IsBool(ws_deflate)) {
+		logr("ws_deflate not a boolean, exiting.\n");
+		goto bail;
+	}
+	const cJSON *ws_takeover = cJSON_GetObjectItem(config, "ws_deflate_context_takeover");
+	if (ws_takeover && !cJSON_IsBool(ws_takeover)) {
+		logr("ws_deflate_context_takeover not a boolean, exiting.\n");
+		goto bail;
+	}
+	// Optional, see handle_req_subscribe()
+	const cJSON *sub_maxrate = cJSON_GetObjectItem(config, "subscribe_max_rate");
+	if (sub_maxrate && (!cJSON_IsNumber(sub_maxrate) || sub_maxrate->valuedouble <= 0)) {
+		logr("subscribe_max_rate not a positive number, exiting.\n");
+		goto bail;
+	}
+	const cJSON *sub_persecs = cJSON_GetObjectItem(config, "subscribe_per_seconds");
+	if (sub_persecs && (!cJSON_IsNumber(sub_persecs) || sub_persecs->valuedouble <= 0)) {
+		logr("subscribe_per_seconds not a positive number, exiting.\n");
+		goto bail;
+	}
+	// Optional, see is_keeping_up()
+	const cJSON *max_backlog = cJSON_GetObjectItem(config, "max_send_backlog_kb");
+	if (max_backlog && (!cJSON_IsNumber(max_backlog) || max_backlog->valueint < 1)) {
+		logr("max_send_backlog_kb not a positive number, exiting.\n");
+		goto bail;
+	}
+	// Optional, see find_host()
+	const cJSON *max_hosts = cJSON_GetObjectItem(config, "max_cached_hosts");
+	if (max_hosts && (!cJSON_IsNumber(max_hosts) || max_hosts->valueint < 1)) {
+		logr("max_cached_hosts not a positive number, exiting.\n");
+		goto bail;
+	}
+	// Optional, see handle_req_get_updates()
+	const cJSON *tu_history = cJSON_GetObjectItem(config, "tile_update_history");
+	if (tu_history && (!cJSON_IsNumber(tu_history) || tu_history->valueint < 1)) {
+		logr("tile_update_history not a positive number, exiting.\n");
+		goto bail;
+	}
+	// Optional, see compress_chunks()
+	const cJSON *compress_threads = cJSON_GetObjectItem(config, "compress_threads");
+	if (compress_threads && (!cJSON_IsNumber(compress_threads) || compress_threads->valueint < 0)) {
+		logr("compress_threads not a non-negative number, exiting.\n");
+		goto bail;
+	}
+	// Optional, see worker_thread()
+	const cJSON *cc_interval = cJSON_GetObjectItem(config, "canvas_cache_interval_ms");
+	if (cc_interval && (!cJSON_IsNumber(cc_interval) || cc_interval->valueint < 0)) {
+		logr("canvas_cache_interval_ms not a non-negative number, exiting.\n");
+		goto bail;
+	}
+	// Optional, 0 sends tile updates once per event loop tick
+	const cJSON *tu_interval = cJSON_GetObjectItem(config, "tile_update_interval_ms");
+	if (tu_interval && (!cJSON_IsNumber(tu_interval) || tu_interval->valueint < 0)) {
+		logr("tile_update_interval_ms not a non-negative number, exiting.\n");
+		goto bail;
+	}
 	const cJSON *administrators  = cJSON_GetObjectItem(config, "administrators");
 	if (!cJSON_IsArray(administrators)) {
 		logr("administrators not an array, exiting.\n");
@@ -1492,17 +2627,58 @@ void load_config(struct canvas *c) {
 	c->settings.getcanvas_per_seconds = gc_persecs->valuedouble;
 	c->settings.setpixel_max_rate = sp_maxrate->valuedouble;
 	c->settings.setpixel_per_seconds = sp_persecs->valuedouble;
+	c->settings.subscribe_max_rate = sub_maxrate ? sub_maxrate->valuedouble : 10.0f;
+	c->settings.subscribe_per_seconds = sub_persecs ? sub_persecs->valuedouble : 1.0f;
 	c->settings.max_users_per_ip = max_users->valueint;
 	c->settings.canvas_save_interval_sec = cs_interval->valueint;
 	c->settings.websocket_ping_interval_sec = wp_interval->valueint;
 	c->settings.users_save_interval_sec = us_interval->valueint;
 	c->settings.kick_inactive_after_sec = kick_secs->valueint;
 	c->settings.max_concurrent_users = max_concurrent->valueint;
+	c->settings.tile_update_interval_ms = tu_interval ? (size_t)tu_interval->valueint : 0;
+	c->settings.max_send_backlog_kb = max_backlog ? (size_t)max_backlog->valueint : 512;
+	c->settings.max_cached_hosts = max_hosts ? (size_t)max_hosts->valueint : 10000;
+	// On reload, so a raised limit doesn't leave long chains behind. The hosts are the db thread's by then.
+	if (c->db.started) {
+		struct db_job *job = calloc(1, sizeof(*job));
+		job->type = DB_RESIZE_HOSTS;
+		queue_db_job(c, job);
+	}
+	c->settings.canvas_cache_interval_ms = cc_interval ? (size_t)cc_interval->valueint : 250;
+	// The history is allocated once, at startup
+	size_t history = tu_history ? (size_t)tu_history->valueint : 65536;
+	if (c->update_history && history != c->settings.tile_update_history) {
+		logr("tile_update_history can't be changed at runtime, restart to apply.\n");
+	} else {
+		c->settings.tile_update_history = history;
+	}
+	c->settings.ws_deflate = cJSON_IsTrue(ws_deflate);
+	// Off by default, so broadcasts are compressed once and shared like the uncompressed frame
+	c->settings.ws_deflate_context_takeover = cJSON_IsTrue(ws_takeover);
+	// Applies to connections made from here on
+	for (size_t i = 0; i < c->reactor_count; ++i) {
+		c->reactors[i].mgr.ws_deflate = c->settings.ws_deflate;
+		c->reactors[i].mgr.ws_deflate_takeover = c->settings.ws_deflate_context_takeover;
+	}
+	size_t threads = reactor_threads ? (size_t)reactor_threads->valueint : 1;
+	if (c->reactor_count && threads != c->settings.reactor_threads) {
+		logr("reactor_threads can't be changed at runtime, restart to apply.\n");
+	} else {
+		c->settings.reactor_threads = threads;
+	}
+	// 0 is one per core
+	threads = compress_threads && compress_threads->valueint ? (size_t)compress_threads->valueint : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	if (c->compressors.threads && threads != c->settings.compress_threads) {
+		logr("compress_threads can't be changed at runtime, restart to apply.\n");
+	} else {
+		c->settings.compress_threads = threads ? threads : 1;
+	}
 	strncpy(c->settings.listen_url, listen_url->valuestring, sizeof(c->settings.listen_url) - 1);
 	strncpy(c->settings.dbase_file, dbase_file->valuestring, sizeof(c->settings.dbase_file) - 1);
 
-	// Load up administrator list
-	list_destroy(&c->administrators);
+	// Load up administrator list, and swap it in once it's done
+	struct administrator *admins = calloc(cJSON_GetArraySize(administrators), sizeof(*admins));
+	size_t admin_count = 0;
 	cJSON *admin = NULL;
 	cJSON_ArrayForEach(admin, administrators) {
 		if (!cJSON_IsObject(admin)) continue;
@@ -1526,13 +2702,18 @@ void load_config(struct canvas *c) {
 			.can_cleanup   = cJSON_IsBool(cleanup)   ? cleanup->valueint   : false,
 		};
 		strncpy(a.uuid, uuid->valuestring, sizeof(a.uuid) - 1);
-		list_append(c->administrators, a);
+		admins[admin_count++] = a;
 	}
+	pthread_mutex_lock(&c->config_lock);
+	free(c->administrators);
+	c->administrators = admins;
+	c->administrator_count = admin_count;
+	pthread_mutex_unlock(&c->config_lock);
 
 	if (c->color_list.colors) free(c->color_list.colors);
-	c->color_list.amount = cJSON_GetArraySize(colors);
-	c->color_list.colors = calloc(c->color_list.amount, sizeof(struct color));
-	for (size_t i = 0; i < c->color_list.amount; ++i) {
+	size_t color_count = cJSON_GetArraySize(colors);
+	c->color_list.colors = calloc(color_count, sizeof(struct color));
+	for (size_t i = 0; i < color_count; ++i) {
 		cJSON *color = cJSON_GetArrayItem(colors, i);
 		if (!cJSON_IsArray(color) || cJSON_GetArraySize(color) != 4) {
 			logr("Color at index %lu not an array of format [R,G,B,id]\n", i);
@@ -1545,8 +2726,11 @@ void load_config(struct canvas *c) {
 			cJSON_GetArrayItem(color, 3)->valueint,
 		};
 	}
+	// Requests check color ids against it on the reactors as this runs
+	__atomic_store_n(&c->color_list.amount, color_count, __ATOMIC_RELAXED);
 
 	update_color_response_cache(c);
+	update_canvas_palette(c);
 
 	logr("Loaded conf:\n");
 	printf("%s\n", conf);
@@ -1559,75 +2743,768 @@ bail:
 	exit(-1);
 }
 
-static void user_tile_increment_fn(void *arg) {
+//ws ping. TODO: Probably do this from the client side instead.
+static void user_ping_fn(void *arg) {
+	struct user *user = (struct user *)arg;
+	struct reactor *r = conn_reactor(user->socket);
+	mg_ws_send(user->socket, NULL, 0, WEBSOCKET_OP_PING);
+	timer_wheel_add(&r->wheel, &user->ping_timer, 1000 * r->canvas->settings.websocket_ping_interval_sec);
+}
+
+// Fires when the user could have been idle for kick_inactive_after_sec.
+// If they did something in the meantime, check again when that could next be true.
+static void user_idle_fn(void *arg) {
 	struct user *user = (struct user *)arg;
-	// tile_regen_seconds may change in level_up(), so keep it updated here.
-	user->tile_increment_timer->period_ms = user->tile_regen_seconds * 1000;
-	if (user->remaining_tiles >= user->max_tiles) return;
-	user->remaining_tiles++;
-	char response[2];
-	response[0] = RES_TILE_INCREMENT;
-	response[1] = 1;
-	mg_ws_send(user->socket, response, 2, WEBSOCKET_OP_BINARY);
+	struct reactor *r = conn_reactor(user->socket);
+	struct canvas *c = r->canvas;
+	uint64_t current_time_unix = (unsigned)time(NULL);
+	size_t sec_since_last_event = current_time_unix - user->last_event_unix;
+	if (sec_since_last_event > c->settings.kick_inactive_after_sec) {
+		logr("Kicking inactive user %s\n", user->uuid);
+		kick_with_message(c, user, "You haven't drawn anything for a while, so you were disconnected.", "Reconnect", NULL);
+	} else {
+		size_t sec_left = c->settings.kick_inactive_after_sec - sec_since_last_event + 1;
+		timer_wheel_add(&r->wheel, &user->idle_timer, 1000 * sec_left);
+	}
 }
 
-void start_user_timer(struct user *user, struct mg_mgr *mgr) {
-	user->tile_increment_timer = mg_timer_add(mgr, user->tile_regen_seconds * 1000, MG_TIMER_REPEAT, user_tile_increment_fn, user);
+void start_user_timers(struct user *user) {
+	struct reactor *r = conn_reactor(user->socket);
+	const struct params *settings = &r->canvas->settings;
+	wheel_timer_init(&user->ping_timer, user_ping_fn, user);
+	wheel_timer_init(&user->idle_timer, user_idle_fn, user);
+	timer_wheel_add(&r->wheel, &user->ping_timer, 1000 * settings->websocket_ping_interval_sec);
+	timer_wheel_add(&r->wheel, &user->idle_timer, 1000 * (settings->kick_inactive_after_sec + 1));
 }
 
-void update_getcanvas_cache(struct canvas *c) {
-	size_t tilecount = c->edge_length * c->edge_length;
+void stop_user_timers(struct user *user) {
+	struct reactor *r = conn_reactor(user->socket);
+	timer_wheel_cancel(&r->wheel, &user->ping_timer);
+	timer_wheel_cancel(&r->wheel, &user->idle_timer);
+}
+
+// canvas chunks
 
-	uint8_t *pixels = malloc(tilecount);
-	for (size_t i = 0; i < tilecount; ++i) {
-		pixels[i] = c->tiles[i].color_id;
+void init_canvas_chunks(struct canvas *c) {
+	for (size_t level = 0; level < CANVAS_LEVELS; ++level) {
+		struct chunk_plane *plane = &c->levels[level];
+		plane->edge_length = (c->edge_length + (1U << level) - 1) >> level;
+		plane->chunks_per_edge = (plane->edge_length + CANVAS_CHUNK_EDGE - 1) / CANVAS_CHUNK_EDGE;
+		plane->colors = calloc(plane->edge_length * plane->edge_length, sizeof(*plane->colors));
+		plane->chunks = calloc(plane->chunks_per_edge * plane->chunks_per_edge, sizeof(*plane->chunks));
 	}
+	size_t count = c->levels[0].chunks_per_edge * c->levels[0].chunks_per_edge;
+	c->dirty_chunks = calloc((count + 63) / 64, sizeof(uint64_t));
+	// Everything needs compressing the first time around
+	for (size_t i = 0; i < count; ++i) {
+		c->dirty_chunks[i / 64] |= 1ULL << (i % 64);
+	}
+	c->chunks_dirty = true;
+}
 
-	size_t compressed_len = compressBound(tilecount);
-	float orig_len = compressed_len;
-	uint8_t *compressed = malloc(compressed_len);
-	int ret = compress(compressed, &compressed_len, pixels, tilecount);
-	float compression_ratio = 100.0f * ((float)compressed_len / orig_len);
-	free(pixels);
-	if (ret != Z_OK) {
-		if (ret == Z_MEM_ERROR) logr("Z_MEM_ERROR\n");
-		if (ret == Z_BUF_ERROR) logr("Z_BUF_ERROR\n");
+void free_canvas_chunks(struct canvas *c) {
+	for (size_t level = 0; level < CANVAS_LEVELS; ++level) {
+		struct chunk_plane *plane = &c->levels[level];
+		for (size_t i = 0; i < (size_t)plane->chunks_per_edge * plane->chunks_per_edge; ++i) {
+			for (size_t codec = 0; codec < CODEC_COUNT; ++codec) {
+				mg_shared_unref(plane->chunks[i].blobs[codec].data);
+			}
+		}
+		free(plane->chunks);
+		free(plane->colors);
+		free(c->level_copies[level].colors);
+		free(c->level_copies[level].versions);
 	}
+	free(c->dirty_chunks);
+	for (size_t format = 0; format < CANVAS_FORMAT_COUNT; ++format) {
+		mg_shared_unref(c->canvas_caches[format].frame);
+	}
+}
 
-	uint8_t *old = NULL;
-	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
-	pthread_mutex_lock(&c->canvas_cache_lock);
-	old = c->canvas_cache;
-	c->canvas_cache = compressed;
-	c->canvas_cache_len = compressed_len;
-	c->canvas_cache_compression_ratio = compression_ratio;
-	pthread_mutex_unlock(&c->canvas_cache_lock);
-	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
-	free(old);
+// Rebuild the palette from the color list, and repack everything with it
+void update_canvas_palette(struct canvas *c) {
+	bool is_color[256] = { 0 };
+	for (size_t i = 0; i < c->color_list.amount; ++i) {
+		is_color[c->color_list.colors[i].color_id] = true;
+	}
+	pthread_mutex_lock(&c->chunks_lock);
+	struct canvas_palette *p = &c->palette;
+	memset(p, 0, sizeof(*p));
+	for (size_t id = 0; id < 256; ++id) {
+		if (!is_color[id]) continue;
+		p->index_of[id] = p->count;
+		p->ids[p->count++] = id;
+	}
+	p->bits = 1;
+	while ((1U << p->bits) < p->count) p->bits++;
+	// Nothing can go out packed with the old palette from here on
+	for (size_t level = 0; level < CANVAS_LEVELS; ++level) {
+		struct chunk_plane *plane = &c->levels[level];
+		for (size_t i = 0; plane->chunks && i < (size_t)plane->chunks_per_edge * plane->chunks_per_edge; ++i) {
+			plane->chunks[i].version++;
+		}
+	}
+	c->canvas_generation++;
+	pthread_mutex_unlock(&c->chunks_lock);
+	// Wake the worker to repack it all
+	size_t count = (size_t)c->levels[0].chunks_per_edge * c->levels[0].chunks_per_edge;
+	for (size_t i = 0; c->dirty_chunks && i < count; ++i) {
+		dirty_chunk(c, i);
+	}
 }
 
-void *worker_thread(void *arg) {
-	struct canvas *c = (struct canvas *)arg;
+// Palette indices of colors, palette->bits each, most significant bit first.
+// The last byte is padded with zeroes. Returns how many bytes it took.
+static size_t pack_colors(uint8_t *dst, const uint8_t *colors, size_t count, const struct canvas_palette *palette) {
+	unsigned bits = palette->bits;
+	uint32_t acc = 0;
+	unsigned pending = 0; // Bits in acc not written out yet
+	size_t len = 0;
+	for (size_t i = 0; i < count; ++i) {
+		acc = (acc << bits) | palette->index_of[colors[i]];
+		pending += bits;
+		while (pending >= 8) {
+			pending -= 8;
+			dst[len++] = acc >> pending;
+		}
+	}
+	if (pending) dst[len++] = acc << (8 - pending);
+	return len;
+}
+
+// Where chunk of plane starts, and how big it is. Chunks on the right and bottom edges may be cut short.
+static void chunk_bounds(const struct chunk_plane *plane, size_t chunk, size_t *x0, size_t *y0, size_t *width, size_t *height) {
+	*x0 = (chunk % plane->chunks_per_edge) * CANVAS_CHUNK_EDGE;
+	*y0 = (chunk / plane->chunks_per_edge) * CANVAS_CHUNK_EDGE;
+	*width = plane->edge_length - *x0 < CANVAS_CHUNK_EDGE ? plane->edge_length - *x0 : CANVAS_CHUNK_EDGE;
+	*height = plane->edge_length - *y0 < CANVAS_CHUNK_EDGE ? plane->edge_length - *y0 : CANVAS_CHUNK_EDGE;
+}
+
+// Copies the colors of chunk out of colors, laid out like plane, into dst row by row. Returns how many there are.
+static size_t copy_chunk_colors(uint8_t *dst, const uint8_t *colors, const struct chunk_plane *plane, size_t chunk) {
+	size_t x0, y0, width, height;
+	chunk_bounds(plane, chunk, &x0, &y0, &width, &height);
+	for (size_t y = 0; y < height; ++y) {
+		memcpy(dst + y * width, colors + x0 + (y0 + y) * plane->edge_length, width);
+	}
+	return width * height;
+}
+
+// Compresses count colors of a chunk with codec, bit-packing them with palette first for packed codecs.
+// Touches nothing shared, so it's safe without locks. NULL if it fails.
+static struct mg_shared *compress_chunk(const uint8_t *colors, size_t count, enum codec_id codec, const struct canvas_palette *palette) {
+	const uint8_t *src = colors;
+	size_t src_len = count;
+	uint8_t packed[CANVAS_CHUNK_EDGE * CANVAS_CHUNK_EDGE];
+	if (codecs[codec].packed) {
+		src_len = pack_colors(packed, colors, count, palette);
+		src = packed;
+	}
+	// Every codec's bound for a chunk fits with room to spare
+	uint8_t compressed[2 * CANVAS_CHUNK_EDGE * CANVAS_CHUNK_EDGE];
+	size_t bound = codecs[codec].bound(src_len);
+	size_t len = bound <= sizeof(compressed) ? codecs[codec].compress(compressed, bound, src, src_len, codecs[codec].level) : 0;
+	if (!len) {
+		logr("Failed to compress canvas chunk with %s\n", codecs[codec].name);
+		return NULL;
+	}
+	return mg_shared_new(compressed, len);
+}
+
+// Compresses a chunk of the worker's copy of the level for the pool's job
+static void run_compress_job(struct compress_pool *pool, struct compress_job *job) {
+	struct canvas *c = pool->canvas;
+	uint8_t colors[CANVAS_CHUNK_EDGE * CANVAS_CHUNK_EDGE];
+	size_t count = copy_chunk_colors(colors, c->level_copies[pool->level].colors, &c->levels[pool->level], job->chunk);
+	job->blob = compress_chunk(colors, count, pool->codec, &c->palette_copy);
+}
+
+// Takes jobs off the current batch until there are none left. Returns with pool->lock held.
+static void compress_pool_work(struct compress_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->count) {
+		struct compress_job *job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+		run_compress_job(pool, job);
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->done == pool->count) pthread_cond_signal(&pool->work_done);
+	}
+}
+
+static void *compress_thread(void *arg) {
+	struct compress_pool *pool = (struct compress_pool *)arg;
 	while (true) {
-		sleep_ms(1000); //TODO: configurable?
-		// Compress and swap canvas cache data
-		if (!c->dirty) continue;
-		update_getcanvas_cache(c);
+		compress_pool_work(pool);
+		if (pool->stop) break;
+		pthread_cond_wait(&pool->work_ready, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
 	}
+	pthread_mutex_unlock(&pool->lock);
 	return NULL;
 }
 
-static void callback_fn(struct mg_connection *c, int event_type, void *event_data, void *arg) {
-	struct canvas *canvas = (struct canvas *)arg;
+// Worker only.
+// Compresses the first count jobs in compressors.jobs from the worker's copy of level, with codec.
+// Chunks are independent, so the pool threads and the worker each take them one by one until they run out.
+static void compress_chunks(struct canvas *c, size_t level, enum codec_id codec, size_t count) {
+	if (!count) return;
+	struct compress_pool *pool = &c->compressors;
+	pthread_mutex_lock(&pool->lock);
+	pool->canvas = c;
+	pool->level = level;
+	pool->codec = codec;
+	pool->count = count;
+	pool->next = 0;
+	pool->done = 0;
+	if (count > 1) pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+	compress_pool_work(pool);
+	while (pool->done < pool->count) pthread_cond_wait(&pool->work_done, &pool->lock);
+	pool->count = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	if (event_type == MG_EV_HTTP_MSG) {
-		struct mg_http_message *msg = (struct mg_http_message *)event_data;
-		if (mg_http_match_uri(msg, "/ws")) {
-			// This block here grabs the client IP address and stores it in the
-			// mg_connection.label convenience string provided by mongoose.
-			// We only use IPs as an identifier to prevent abuse by limiting
-			// how many accounts a single IP can generate.
-			struct mg_str *fwd_header = mg_http_get_header(msg, "X-Forwarded-For");
+// The worker makes one more, so compress_threads - 1 of them
+void start_compress_threads(struct canvas *c) {
+	struct compress_pool *pool = &c->compressors;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	// Level 0 has the most of them
+	pool->jobs = calloc((size_t)c->levels[0].chunks_per_edge * c->levels[0].chunks_per_edge, sizeof(*pool->jobs));
+	pool->thread_count = c->settings.compress_threads - 1;
+	pool->threads = calloc(pool->thread_count + 1, sizeof(*pool->threads));
+	for (size_t i = 0; i < pool->thread_count; ++i) {
+		if (pthread_create(&pool->threads[i], NULL, compress_thread, pool)) {
+			logr("Failed to start compress thread %lu\n", i);
+			pool->thread_count = i;
+			break;
+		}
+		char name[16];
+		snprintf(name, sizeof(name), "Compress%u", (uint16_t)i);
+		pthread_setname_np(pool->threads[i], name);
+	}
+}
+
+void stop_compress_threads(struct canvas *c) {
+	struct compress_pool *pool = &c->compressors;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	free(pool->jobs);
+	pthread_cond_destroy(&pool->work_ready);
+	pthread_cond_destroy(&pool->work_done);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+// The color most of them have, or current if it's as common as any
+static uint8_t most_common_color(const uint8_t *colors, size_t count, uint8_t current) {
+	uint8_t best = current;
+	size_t best_count = 0;
+	for (size_t i = 0; i < count; ++i) best_count += colors[i] == current;
+	for (size_t i = 0; i < count; ++i) {
+		size_t n = 0;
+		for (size_t j = 0; j < count; ++j) n += colors[j] == colors[i];
+		if (n > best_count) {
+			best = colors[i];
+			best_count = n;
+		}
+	}
+	return best;
+}
+
+// Must be called with chunks_lock held.
+// Scales the x0..x1, y0..y1 tiles (exclusive) of the level below plane down into it,
+// and bumps the versions of the chunks that touches.
+static void downsample_area(struct chunk_plane *plane, const struct chunk_plane *below, size_t x0, size_t y0, size_t x1, size_t y1) {
+	x0 /= 2;
+	y0 /= 2;
+	x1 = (x1 + 1) / 2;
+	y1 = (y1 + 1) / 2;
+	for (size_t y = y0; y < y1; ++y) {
+		for (size_t x = x0; x < x1; ++x) {
+			uint8_t colors[4];
+			size_t count = 0;
+			for (size_t by = y * 2; by < y * 2 + 2 && by < below->edge_length; ++by) {
+				for (size_t bx = x * 2; bx < x * 2 + 2 && bx < below->edge_length; ++bx) {
+					colors[count++] = below->colors[bx + by * below->edge_length];
+				}
+			}
+			uint8_t *color = &plane->colors[x + y * plane->edge_length];
+			*color = most_common_color(colors, count, *color);
+		}
+	}
+	for (size_t cy = y0 / CANVAS_CHUNK_EDGE; cy <= (y1 - 1) / CANVAS_CHUNK_EDGE; ++cy) {
+		for (size_t cx = x0 / CANVAS_CHUNK_EDGE; cx <= (x1 - 1) / CANVAS_CHUNK_EDGE; ++cx) {
+			plane->chunks[cx + cy * plane->chunks_per_edge].version++;
+		}
+	}
+}
+
+// Copies chunks changed since the last call into level 0, scales them down into the levels
+// after it, and bumps the versions of the chunks that touches so every codec recompresses them.
+// Compressing is left to the worker, which doesn't need chunks_lock for it.
+void snapshot_dirty_chunks(struct canvas *c) {
+	struct chunk_plane *canvas = &c->levels[0];
+	size_t count = (size_t)canvas->chunks_per_edge * canvas->chunks_per_edge;
+	pthread_mutex_lock(&c->chunks_lock);
+	// Every update numbered before this was placed before now, and so is in the snapshot
+	c->snapshot_seq = __atomic_load_n(&c->update_seq, __ATOMIC_ACQUIRE);
+	// Cleared before the bits, so a chunk getting dirty while we copy sets it again
+	if (!__atomic_exchange_n(&c->chunks_dirty, false, __ATOMIC_ACQ_REL)) goto out;
+	c->canvas_generation++;
+	for (size_t w = 0; w < (count + 63) / 64; ++w) {
+		if (!__atomic_load_n(&c->dirty_chunks[w], __ATOMIC_RELAXED)) continue;
+		uint64_t bits = __atomic_exchange_n(&c->dirty_chunks[w], 0, __ATOMIC_ACQUIRE);
+		while (bits) {
+			size_t chunk = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			canvas->chunks[chunk].version++;
+			size_t x0 = (chunk % canvas->chunks_per_edge) * CANVAS_CHUNK_EDGE;
+			size_t y0 = (chunk / canvas->chunks_per_edge) * CANVAS_CHUNK_EDGE;
+			size_t x1 = c->edge_length - x0 < CANVAS_CHUNK_EDGE ? c->edge_length : x0 + CANVAS_CHUNK_EDGE;
+			size_t y1 = c->edge_length - y0 < CANVAS_CHUNK_EDGE ? c->edge_length : y0 + CANVAS_CHUNK_EDGE;
+			// Tiles keep getting placed while we copy
+			for (size_t y = y0; y < y1; ++y) {
+				for (size_t x = x0; x < x1; ++x) {
+					canvas->colors[x + y * c->edge_length] = __atomic_load_n(&c->tile_colors[x + y * c->edge_length], __ATOMIC_RELAXED);
+				}
+			}
+			for (size_t level = 1; level < CANVAS_LEVELS; ++level) {
+				downsample_area(&c->levels[level], &c->levels[level - 1], x0, y0, x1, y1);
+				x0 /= 2;
+				y0 /= 2;
+				x1 = (x1 + 1) / 2;
+				y1 = (y1 + 1) / 2;
+			}
+		}
+	}
+out:
+	pthread_mutex_unlock(&c->chunks_lock);
+}
+
+// The blobs of codec for the chunks in rect, row by row, laid out as RES_CANVAS_CHUNKS or RES_CANVAS_PACKED
+// for a level with edge_length tiles. prefix_len bytes are left free at the start for the caller.
+// Missing blobs go out empty. Needs no locks, the blobs are immutable.
+static uint8_t *canvas_chunks_message(const struct canvas_palette *palette, uint32_t edge_length, enum codec_id codec,
+		const struct chunk_rect *rect, struct mg_shared *const *blobs, size_t prefix_len, size_t *message_len, size_t *compressed_len) {
+	size_t header_len = prefix_len + CANVAS_CHUNKS_HEADER_LEN;
+	if (codecs[codec].packed) header_len += 1 + sizeof(uint16_t) + palette->count;
+	size_t count = (size_t)rect->width * rect->height;
+	size_t len = header_len;
+	for (size_t n = 0; n < count; ++n) {
+		len += sizeof(uint32_t) + (blobs[n] ? blobs[n]->len : 0);
+	}
+	uint8_t *buf = malloc(len);
+	uint8_t *p = buf + prefix_len;
+	*p++ = codecs[codec].packed ? RES_CANVAS_PACKED : RES_CANVAS_CHUNKS;
+	*p++ = codec;
+	uint16_t edge = htons(edge_length);
+	memcpy(p, &edge, sizeof(edge));
+	p += sizeof(edge);
+	edge = htons(CANVAS_CHUNK_EDGE);
+	memcpy(p, &edge, sizeof(edge));
+	p += sizeof(edge);
+	if (codecs[codec].packed) {
+		*p++ = palette->bits;
+		uint16_t palette_len = htons(palette->count);
+		memcpy(p, &palette_len, sizeof(palette_len));
+		p += sizeof(palette_len);
+		memcpy(p, palette->ids, palette->count);
+		p += palette->count;
+	}
+	for (size_t n = 0; n < count; ++n) {
+		uint32_t blob_len = blobs[n] ? blobs[n]->len : 0;
+		uint32_t blob_len_be = htonl(blob_len);
+		memcpy(p, &blob_len_be, sizeof(blob_len_be));
+		p += sizeof(blob_len_be);
+		if (blob_len) memcpy(p, blobs[n]->buf, blob_len);
+		p += blob_len;
+	}
+	*message_len = len;
+	if (compressed_len) *compressed_len = len - header_len;
+	return buf;
+}
+
+// Snapshots the canvas, and takes what the region in reply needs out of it. Only the copies are done
+// under chunks_lock, the chunks without a fresh blob get compressed by finish_region() after.
+// Like resyncs, anything placed after this is still on its way through the mailbox.
+static void take_region(struct canvas *c, struct region_reply *reply) {
+	snapshot_dirty_chunks(c);
+	const struct chunk_plane *plane = &c->levels[reply->level];
+	const struct chunk_rect *rect = &reply->rect;
+	reply->edge_length = plane->edge_length;
+	reply->chunks = calloc((size_t)rect->width * rect->height, sizeof(*reply->chunks));
+	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+	pthread_mutex_lock(&c->chunks_lock);
+	reply->palette = c->palette;
+	for (size_t y = 0; y < rect->height; ++y) {
+		for (size_t x = 0; x < rect->width; ++x) {
+			struct region_chunk *out = &reply->chunks[x + y * rect->width];
+			size_t chunk = rect->x + x + (rect->y + y) * plane->chunks_per_edge;
+			const struct chunk_blob *blob = &plane->chunks[chunk].blobs[reply->codec];
+			if (blob->data && blob->version == plane->chunks[chunk].version) {
+				mg_shared_ref(blob->data);
+				out->blob = blob->data;
+				continue;
+			}
+			out->colors = malloc(CANVAS_CHUNK_EDGE * CANVAS_CHUNK_EDGE);
+			out->count = copy_chunk_colors(out->colors, plane->colors, plane, chunk);
+		}
+	}
+	pthread_mutex_unlock(&c->chunks_lock);
+	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+}
+
+// Needs no locks.
+// Compresses what take_region() copied, and lays the region out as RES_CANVAS_REGION. Frees what's in reply.
+static uint8_t *finish_region(struct region_reply *reply, size_t *message_len) {
+	const struct chunk_rect *rect = &reply->rect;
+	size_t count = (size_t)rect->width * rect->height;
+	struct mg_shared **blobs = malloc(count * sizeof(*blobs));
+	for (size_t n = 0; n < count; ++n) {
+		struct region_chunk *chunk = &reply->chunks[n];
+		if (chunk->colors) {
+			chunk->blob = compress_chunk(chunk->colors, chunk->count, reply->codec, &reply->palette);
+			free(chunk->colors);
+		}
+		blobs[n] = chunk->blob;
+	}
+	uint8_t *message = canvas_chunks_message(&reply->palette, reply->edge_length, reply->codec, rect, blobs, CANVAS_REGION_HEADER_LEN, message_len, NULL);
+	message[0] = RES_CANVAS_REGION;
+	message[1] = reply->level;
+	uint16_t fields[] = { htons(rect->x), htons(rect->y), htons(rect->width), htons(rect->height) };
+	memcpy(message + 2, fields, sizeof(fields));
+	for (size_t n = 0; n < count; ++n) {
+		mg_shared_unref(blobs[n]);
+	}
+	free(blobs);
+	free(reply->chunks);
+	reply->chunks = NULL;
+	return message;
+}
+
+// Must be called with chunks_lock held.
+// Brings the worker's copy of level up to date with the last snapshot.
+static void copy_level(struct canvas *c, size_t level) {
+	const struct chunk_plane *plane = &c->levels[level];
+	struct level_copy *copy = &c->level_copies[level];
+	size_t count = (size_t)plane->chunks_per_edge * plane->chunks_per_edge;
+	if (!copy->colors) {
+		copy->colors = calloc((size_t)plane->edge_length * plane->edge_length, sizeof(*copy->colors));
+		copy->versions = calloc(count, sizeof(*copy->versions));
+	}
+	for (size_t chunk = 0; chunk < count; ++chunk) {
+		if (copy->versions[chunk] == plane->chunks[chunk].version) continue;
+		size_t x0, y0, width, height;
+		chunk_bounds(plane, chunk, &x0, &y0, &width, &height);
+		for (size_t y = y0; y < y0 + height; ++y) {
+			memcpy(copy->colors + x0 + y * plane->edge_length, plane->colors + x0 + y * plane->edge_length, width);
+		}
+		copy->versions[chunk] = plane->chunks[chunk].version;
+	}
+}
+
+// Worker only.
+// Compresses the chunks of level whose blobs for codec are older than the worker's copy of them,
+// and swaps the new blobs in.
+static void refresh_chunks(struct canvas *c, size_t level, enum codec_id codec) {
+	struct chunk_plane *plane = &c->levels[level];
+	const struct level_copy *copy = &c->level_copies[level];
+	struct compress_job *jobs = c->compressors.jobs;
+	size_t count = 0;
+	for (size_t chunk = 0; chunk < (size_t)plane->chunks_per_edge * plane->chunks_per_edge; ++chunk) {
+		const struct chunk_blob *blob = &plane->chunks[chunk].blobs[codec];
+		if (blob->data && blob->version == copy->versions[chunk]) continue;
+		jobs[count++] = (struct compress_job){ .chunk = chunk, .version = copy->versions[chunk] };
+	}
+	if (!count) return;
+	compress_chunks(c, level, codec, count);
+	pthread_mutex_lock(&c->chunks_lock);
+	for (size_t n = 0; n < count; ++n) {
+		struct chunk_blob *blob = &plane->chunks[jobs[n].chunk].blobs[codec];
+		struct mg_shared *old = blob->data;
+		blob->data = jobs[n].blob;
+		blob->version = jobs[n].version;
+		jobs[n].blob = old;
+	}
+	pthread_mutex_unlock(&c->chunks_lock);
+	// Whoever is still putting a region together with them holds their own refs
+	for (size_t n = 0; n < count; ++n) {
+		mg_shared_unref(jobs[n].blob);
+	}
+}
+
+// Worker only. The worker's copy of level 0 as RES_CANVAS_CHUNKS or RES_CANVAS_PACKED, once refresh_chunks() is done with codec.
+static struct mg_shared *canvas_chunks_frame(struct canvas *c, enum codec_id codec, size_t *compressed_len) {
+	const struct chunk_plane *canvas = &c->levels[0];
+	const struct chunk_rect everything = { 0, 0, canvas->chunks_per_edge, canvas->chunks_per_edge };
+	size_t count = (size_t)canvas->chunks_per_edge * canvas->chunks_per_edge;
+	struct mg_shared **blobs = malloc(count * sizeof(*blobs));
+	for (size_t i = 0; i < count; ++i) {
+		blobs[i] = canvas->chunks[i].blobs[codec].data;
+	}
+	size_t len = 0;
+	uint8_t *buf = canvas_chunks_message(&c->palette_copy, canvas->edge_length, codec, &everything, blobs, 0, &len, compressed_len);
+	free(blobs);
+	struct mg_shared *frame = mg_ws_shared((const char *)buf, len, WEBSOCKET_OP_BINARY);
+	free(buf);
+	return frame;
+}
+
+// Worker only. RES_CANVAS, and the worker's copy of level 0 as one zlib stream
+static struct mg_shared *legacy_canvas_frame(struct canvas *c, size_t *compressed_len) {
+	const struct chunk_plane *canvas = &c->levels[0];
+	size_t count = (size_t)canvas->edge_length * canvas->edge_length;
+	size_t bound = codecs[CODEC_ZLIB].bound(count);
+	uint8_t *buf = malloc(1 + bound);
+	buf[0] = RES_CANVAS;
+	*compressed_len = codecs[CODEC_ZLIB].compress(buf + 1, bound, c->level_copies[0].colors, count, codecs[CODEC_ZLIB].level);
+	if (!*compressed_len) logr("Failed to compress legacy canvas\n");
+	struct mg_shared *frame = mg_ws_shared((const char *)buf, 1 + *compressed_len, WEBSOCKET_OP_BINARY);
+	free(buf);
+	return frame;
+}
+
+// Worker only, right after a snapshot.
+// Copies what changed out of the snapshot, and rebuilds the frames of the wanted formats that are
+// older than it. chunks_lock is only held for the copy and to swap blobs, canvas_cache_lock to swap frames.
+void refresh_canvas_caches(struct canvas *c, const bool *wanted) {
+	// The levels after 0 that regions were asked from, in codecs somebody still uses
+	uint32_t level_codecs[CANVAS_LEVELS] = { 0 };
+	for (size_t level = 1; level < CANVAS_LEVELS; ++level) {
+		uint32_t asked = __atomic_load_n(&c->region_codecs[level], __ATOMIC_RELAXED);
+		for (size_t codec = 0; codec < CODEC_COUNT; ++codec) {
+			if (!(asked & (1U << codec))) continue;
+			if (wanted[codec]) {
+				level_codecs[level] |= 1U << codec;
+			} else {
+				__atomic_and_fetch(&c->region_codecs[level], ~(1U << codec), __ATOMIC_RELAXED);
+			}
+		}
+	}
+	pthread_mutex_lock(&c->chunks_lock);
+	copy_level(c, 0);
+	for (size_t level = 1; level < CANVAS_LEVELS; ++level) {
+		if (level_codecs[level]) copy_level(c, level);
+	}
+	// Copied along with the levels, so the blobs are never packed with a palette they don't match
+	c->palette_copy = c->palette;
+	uint64_t generation = c->canvas_generation;
+	uint32_t seq = c->snapshot_seq;
+	pthread_mutex_unlock(&c->chunks_lock);
+	for (size_t format = 0; format < CANVAS_FORMAT_COUNT; ++format) {
+		if (!wanted[format]) continue;
+		struct canvas_cache *cache = &c->canvas_caches[format];
+		//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+		pthread_mutex_lock(&c->canvas_cache_lock);
+		bool is_stale = !cache->frame || cache->generation != generation;
+		if (!is_stale) cache->seq = seq; // Nothing changed since it was built
+		pthread_mutex_unlock(&c->canvas_cache_lock);
+		//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+		if (!is_stale) continue;
+		size_t compressed_len = 0;
+		struct mg_shared *fresh;
+		if (format == CANVAS_FORMAT_LEGACY) {
+			fresh = legacy_canvas_frame(c, &compressed_len);
+		} else {
+			refresh_chunks(c, 0, (enum codec_id)format);
+			fresh = canvas_chunks_frame(c, (enum codec_id)format, &compressed_len);
+		}
+		if (!fresh) continue;
+		//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+		pthread_mutex_lock(&c->canvas_cache_lock);
+		struct mg_shared *old = cache->frame;
+		cache->frame = fresh;
+		cache->len = compressed_len;
+		cache->compression_ratio = 100.0f * ((float)compressed_len / (c->edge_length * c->edge_length));
+		cache->generation = generation;
+		cache->seq = seq;
+		pthread_mutex_unlock(&c->canvas_cache_lock);
+		//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+		mg_shared_unref(old); // Connections still streaming it hold their own refs
+	}
+	// So regions zoomed out don't have to compress them on the reactors
+	for (size_t level = 1; level < CANVAS_LEVELS; ++level) {
+		for (size_t codec = 0; codec < CODEC_COUNT; ++codec) {
+			if (level_codecs[level] & (1U << codec)) refresh_chunks(c, level, (enum codec_id)codec);
+		}
+	}
+}
+
+// Nobody kept the cache of a format without users fresh, so the first one to come back to it
+// mustn't get what's left in there.
+static void use_canvas_format(struct canvas *c, size_t format) {
+	struct canvas_cache *cache = &c->canvas_caches[format];
+	struct mg_shared *old = NULL;
+	pthread_mutex_lock(&c->canvas_cache_lock);
+	if (!__atomic_fetch_add(&c->format_users[format], 1, __ATOMIC_RELAXED)) {
+		old = cache->frame;
+		cache->frame = NULL;
+	}
+	pthread_mutex_unlock(&c->canvas_cache_lock);
+	mg_shared_unref(old);
+}
+
+static void leave_canvas_format(struct canvas *c, size_t format) {
+	__atomic_sub_fetch(&c->format_users[format], 1, __ATOMIC_RELAXED);
+}
+
+// Has the worker snapshot and refresh the caches soon, even if nothing changed, for users waiting on a frame.
+static void want_canvas_cache(struct canvas *c) {
+	pthread_mutex_lock(&c->worker_lock);
+	if (!c->cache_wanted) {
+		c->cache_wanted = true;
+		pthread_cond_signal(&c->canvas_changed);
+	}
+	pthread_mutex_unlock(&c->worker_lock);
+}
+
+// Worker only. Refresh the caches of the formats connected users get.
+void update_getcanvas_cache(struct canvas *c) {
+	bool wanted[CANVAS_FORMAT_COUNT];
+	for (size_t format = 0; format < CANVAS_FORMAT_COUNT; ++format) {
+		wanted[format] = __atomic_load_n(&c->format_users[format], __ATOMIC_RELAXED) > 0;
+	}
+	refresh_canvas_caches(c, wanted);
+}
+
+// end canvas chunks
+
+// Sleeps until some chunk gets dirty, then snapshots and recompresses it at most once every
+// canvas_cache_interval_ms, so a busy canvas doesn't keep it compressing the same chunks.
+void *worker_thread(void *arg) {
+	struct canvas *c = (struct canvas *)arg;
+	struct timespec last_refresh = { 0 };
+	pthread_mutex_lock(&c->worker_lock);
+	while (!c->worker_stop) {
+		if (!__atomic_load_n(&c->chunks_dirty, __ATOMIC_ACQUIRE) && !c->cache_wanted) {
+			pthread_cond_wait(&c->canvas_changed, &c->worker_lock);
+			continue;
+		}
+		struct timespec now, next = last_refresh;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		next.tv_sec += c->settings.canvas_cache_interval_ms / 1000;
+		next.tv_nsec += (c->settings.canvas_cache_interval_ms % 1000) * 1000000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		// Somebody waiting for a frame doesn't wait out the interval too
+		bool is_throttled = now.tv_sec < next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec < next.tv_nsec);
+		if (is_throttled && !c->cache_wanted) {
+			pthread_cond_timedwait(&c->canvas_changed, &c->worker_lock, &next);
+			continue;
+		}
+		last_refresh = now;
+		c->cache_wanted = false;
+		pthread_mutex_unlock(&c->worker_lock);
+		snapshot_dirty_chunks(c);
+		// Recompress changed chunks and swap canvas cache data
+		update_getcanvas_cache(c);
+		pthread_mutex_lock(&c->worker_lock);
+	}
+	pthread_mutex_unlock(&c->worker_lock);
+	return NULL;
+}
+
+static void handle_ws_message(struct reactor *reactor, struct mg_connection *c, uint8_t op, const char *data, size_t len) {
+	struct canvas *canvas = reactor->canvas;
+	if (op == WEBSOCKET_OP_BINARY) {
+		size_t response_len = 0;
+		char *response = handle_binary_command(canvas, data, len, c, &response_len);
+		if (response) {
+			mg_ws_send(c, response, response_len, WEBSOCKET_OP_BINARY);
+			free(response);
+		}
+		send_pending_region(reactor, c);
+	} else if (op == WEBSOCKET_OP_TEXT) {
+		cJSON *response = handle_command(canvas, data, len, c);
+		char *response_str = cJSON_PrintUnformatted(response);
+		if (response_str) {
+			mg_ws_send(c, response_str, strlen(response_str), WEBSOCKET_OP_TEXT);
+			free(response_str);
+		}
+		cJSON_Delete(response);
+	}
+}
+
+// Where conn_id is in the authing list of r, or -1 if it's not being authenticated
+static ssize_t authing_slot(const struct reactor *r, unsigned long conn_id) {
+	const unsigned long *ids = (const unsigned long *)r->authing.buf;
+	for (size_t i = 0; i < r->authing.len / sizeof(*ids); ++i) {
+		if (ids[i] == conn_id) return (ssize_t)i;
+	}
+	return -1;
+}
+
+static void hold_message(struct reactor *r, unsigned long conn_id, uint8_t op, const char *data, size_t len) {
+	struct held_message held = { .conn_id = conn_id, .op = op, .len = len };
+	mg_iobuf_add(&r->held, r->held.len, &held, sizeof(held), MG_IO_SIZE);
+	mg_iobuf_add(&r->held, r->held.len, data, len, MG_IO_SIZE);
+}
+
+// Takes the messages held for conn_id out of r->held, in the order they came in
+static struct mg_iobuf take_held_messages(struct reactor *r, unsigned long conn_id) {
+	struct mg_iobuf taken = { 0 };
+	size_t offset = 0;
+	while (offset < r->held.len) {
+		struct held_message held;
+		memcpy(&held, r->held.buf + offset, sizeof(held));
+		size_t size = sizeof(held) + held.len;
+		if (held.conn_id == conn_id) {
+			mg_iobuf_add(&taken, taken.len, r->held.buf + offset, size, MG_IO_SIZE);
+			mg_iobuf_del(&r->held, offset, size);
+		} else {
+			offset += size;
+		}
+	}
+	return taken;
+}
+
+// conn_id is done authenticating, one way or the other. Returns what it sent in the meantime.
+static struct mg_iobuf stop_auth(struct reactor *r, unsigned long conn_id) {
+	ssize_t slot = authing_slot(r, conn_id);
+	if (slot >= 0) mg_iobuf_del(&r->authing, slot * sizeof(unsigned long), sizeof(unsigned long));
+	return take_held_messages(r, conn_id);
+}
+
+// Handles what connection sent while it was being authenticated, unless that got it authenticating again
+static void replay_held_messages(struct reactor *r, struct mg_connection *connection, struct mg_iobuf *messages) {
+	size_t offset = 0;
+	while (offset < messages->len) {
+		struct held_message held;
+		memcpy(&held, messages->buf + offset, sizeof(held));
+		const char *data = (const char *)messages->buf + offset + sizeof(held);
+		if (authing_slot(r, connection->id) >= 0) {
+			hold_message(r, connection->id, held.op, data, held.len);
+		} else if (!connection->is_closing && !connection->is_draining) {
+			handle_ws_message(r, connection, held.op, data, held.len);
+		}
+		offset += sizeof(held) + held.len;
+	}
+	mg_iobuf_free(messages);
+}
+
+// fn_data is the user bound to the connection, see connect_user()
+static void callback_fn(struct mg_connection *c, int event_type, void *event_data, void *fn_data) {
+	(void)fn_data;
+	struct reactor *reactor = conn_reactor(c);
+	struct canvas *canvas = reactor->canvas;
+
+	if (event_type == MG_EV_HTTP_MSG) {
+		struct mg_http_message *msg = (struct mg_http_message *)event_data;
+		if (mg_http_match_uri(msg, "/ws")) {
+			// This block here grabs the client IP address and stores it in the
+			// mg_connection.label convenience string provided by mongoose.
+			// We only use IPs as an identifier to prevent abuse by limiting
+			// how many accounts a single IP can generate.
+			struct mg_str *fwd_header = mg_http_get_header(msg, "X-Forwarded-For");
 			if (fwd_header) {
 				struct mg_str copy = mg_strdup(*fwd_header);
 				char *stash = (char *)copy.ptr;
@@ -1650,32 +3527,261 @@ static void callback_fn(struct mg_connection *c, int event_type, void *event_dat
 	} else if (event_type == MG_EV_WS_MSG) {
 		struct mg_ws_message *wm = (struct mg_ws_message *)event_data;
 		uint8_t op = wm->flags & 15;
-		if (op == WEBSOCKET_OP_BINARY) {
-			size_t response_len = 0;
-			char *response = handle_binary_command(canvas, wm->data.ptr, wm->data.len, c, &response_len);
-			if (response) {
-				mg_ws_send(c, response, response_len, WEBSOCKET_OP_BINARY);
-				free(response);
-			}
-		} else if (op == WEBSOCKET_OP_TEXT) {
-			cJSON *response = handle_command(canvas, wm->data.ptr, wm->data.len, c);
-			char *response_str = cJSON_PrintUnformatted(response);
-			if (response_str) {
-				mg_ws_send(c, response_str, strlen(response_str), WEBSOCKET_OP_TEXT);
-				free(response_str);
-			}
-			cJSON_Delete(response);
+		if (authing_slot(reactor, c->id) >= 0) {
+			hold_message(reactor, c->id, op, wm->data.ptr, wm->data.len);
+		} else {
+			handle_ws_message(reactor, c, op, wm->data.ptr, wm->data.len);
 		}
 	} else if (event_type == MG_EV_CLOSE) {
+		if (authing_slot(reactor, c->id) >= 0) {
+			struct mg_iobuf held = stop_auth(reactor, c->id);
+			mg_iobuf_free(&held);
+		}
 		drop_user_with_connection(canvas, c);
 	}
 }
 
-static void ping_timer_fn(void *arg) {
-	struct mg_mgr *mgr = (struct mg_mgr *)arg;
-	for (struct mg_connection *c = mgr->conns; c != NULL && c->is_websocket; c = c->next) {
-		mg_ws_send(c, NULL, 0, WEBSOCKET_OP_PING);
+// Checked before queuing tile updates. Once a client has this much unsent data,
+// we stop feeding it tile updates, and send it the whole canvas when it catches up.
+static bool is_keeping_up(struct reactor *r, struct user *user) {
+	struct backpressure_stats *stats = &r->canvas->backpressure;
+	if (!user->needs_resync) {
+		if (mg_send_backlog(user->socket) <= 1024 * r->canvas->settings.max_send_backlog_kb) return true;
+		user->needs_resync = true;
+		r->resyncs_pending++;
+		__atomic_add_fetch(&stats->fell_behind, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&stats->updates_skipped, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+#define RESYNC_INTERVAL_MS 100
+
+// A ref to the cached frame of format, and in catch_up the tile updates this reactor got after the
+// snapshot it was built from, if any. NULL if there's no frame, or the history doesn't go back that far.
+static struct mg_shared *frame_with_catch_up(struct reactor *r, size_t format, struct mg_shared **catch_up) {
+	struct canvas *c = r->canvas;
+	const struct canvas_cache *cache = &c->canvas_caches[format];
+	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+	pthread_mutex_lock(&c->canvas_cache_lock);
+	struct mg_shared *frame = cache->frame;
+	uint32_t seq = cache->seq;
+	if (frame) mg_shared_ref(frame);
+	pthread_mutex_unlock(&c->canvas_cache_lock);
+	//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!//!
+	*catch_up = NULL;
+	if (!frame) return NULL;
+	uint32_t missed = r->delivered_seq - seq;
+	if ((int32_t)missed <= 0) return frame; // Has everything delivered here
+	pthread_mutex_lock(&c->broadcast_lock);
+	if (c->update_seq - seq > c->update_history_len) {
+		pthread_mutex_unlock(&c->broadcast_lock);
+		mg_shared_unref(frame);
+		return NULL;
+	}
+	size_t len = 0;
+	uint8_t *updates = tile_updates_since(c, seq, missed, &len);
+	pthread_mutex_unlock(&c->broadcast_lock);
+	if (format == CANVAS_FORMAT_LEGACY) {
+		*catch_up = legacy_tile_updates(updates, len);
+	} else {
+		*catch_up = mg_ws_shared((const char *)updates, len, WEBSOCKET_OP_BINARY);
+	}
+	free(updates);
+	return frame;
+}
+
+// Send the canvas to clients that fell behind and have since drained their send queue, or are waiting for
+// their first one. It comes from the cache the worker keeps, so no compressing here. The tile updates after
+// its snapshot follow from the history, anything newer than those is still on its way through the mailbox.
+static void resync_timer_fn(void *arg) {
+	struct reactor *r = (struct reactor *)arg;
+	if (!r->resyncs_pending) return;
+	struct canvas *c = r->canvas;
+	// For each format the clients use
+	struct mg_shared *frames[CANVAS_FORMAT_COUNT] = { 0 };
+	struct mg_shared *catch_ups[CANVAS_FORMAT_COUNT] = { 0 };
+	bool looked_up[CANVAS_FORMAT_COUNT] = { 0 };
+	bool want_newer = false;
+	struct ilist_node *node = NULL;
+	ilist_foreach(node, r->sockets) {
+		struct user *user = ilist_entry(node, struct user, reactor_node);
+		if (!user->needs_resync || mg_send_backlog(user->socket)) continue;
+		size_t format = canvas_format(user);
+		if (!looked_up[format]) {
+			frames[format] = frame_with_catch_up(r, format, &catch_ups[format]);
+			looked_up[format] = true;
+		}
+		if (!frames[format]) {
+			want_newer = true;
+			continue;
+		}
+		mg_send_shared(user->socket, frames[format]);
+		if (catch_ups[format]) mg_send_shared(user->socket, catch_ups[format]);
+		user->needs_resync = false;
+		r->resyncs_pending--;
+		__atomic_add_fetch(&c->backpressure.resyncs, 1, __ATOMIC_RELAXED);
+	}
+	if (want_newer) want_canvas_cache(c);
+	for (size_t format = 0; format < CANVAS_FORMAT_COUNT; ++format) {
+		mg_shared_unref(frames[format]);
+		mg_shared_unref(catch_ups[format]);
+	}
+}
+
+// Send subscribed users the part of a RES_TILE_UPDATES frame in the chunks they're subscribed to.
+// Each update is looked up in the chunk it's in, so this costs per subscriber of the chunks touched,
+// not per user. Their entries are numbered as the last ones of the batch, so clients catching up
+// after a reconnect still know where they left off.
+static void deliver_filtered_updates(struct reactor *r, struct mg_shared *frame) {
+	struct mg_str data = mg_ws_shared_data(frame);
+	const uint8_t *updates = (const uint8_t *)data.ptr;
+	uint32_t first_seq;
+	memcpy(&first_seq, updates + 1, sizeof(first_seq));
+	first_seq = ntohl(first_seq);
+	size_t count = (data.len - TILE_UPDATES_HEADER_LEN) / TILE_UPDATE_ENTRY_SIZE;
+	// Fixed at startup
+	uint32_t edge_length = r->canvas->edge_length;
+	uint32_t chunks_per_edge = r->canvas->levels[0].chunks_per_edge;
+	size_t touched = 0;
+	for (size_t n = 0; n < count; ++n) {
+		const uint8_t *entry = updates + TILE_UPDATES_HEADER_LEN + n * TILE_UPDATE_ENTRY_SIZE;
+		uint32_t i;
+		memcpy(&i, entry, sizeof(i));
+		i = ntohl(i);
+		size_t chunk = (i % edge_length) / CANVAS_CHUNK_EDGE + (i / edge_length) / CANVAS_CHUNK_EDGE * chunks_per_edge;
+		const struct chunk_subscribers *s = &r->subscribers[chunk];
+		for (uint32_t k = 0; k < s->count; ++k) {
+			struct user *user = s->users[k];
+			if (!user->filtered_updates.len) {
+				mg_iobuf_add(&user->filtered_updates, 0, NULL, TILE_UPDATES_HEADER_LEN, MG_IO_SIZE);
+				r->touched[touched++] = user;
+			}
+			mg_iobuf_add(&user->filtered_updates, user->filtered_updates.len, entry, TILE_UPDATE_ENTRY_SIZE, MG_IO_SIZE);
+		}
+	}
+	for (size_t n = 0; n < touched; ++n) {
+		struct user *user = r->touched[n];
+		struct mg_iobuf *buf = &user->filtered_updates;
+		size_t sent = (buf->len - TILE_UPDATES_HEADER_LEN) / TILE_UPDATE_ENTRY_SIZE;
+		put_tile_updates_header(buf->buf, first_seq + (uint32_t)(count - sent));
+		if (is_keeping_up(r, user)) mg_ws_send(user->socket, (const char *)buf->buf, buf->len, WEBSOCKET_OP_BINARY);
+		buf->len = 0;
+	}
+}
+
+static struct mg_connection *find_connection(struct reactor *r, unsigned long conn_id) {
+	for (struct mg_connection *socket = r->mgr.conns; socket != NULL; socket = socket->next) {
+		if (socket->id == conn_id) return socket;
+	}
+	return NULL;
+}
+
+static void deliver_mail(struct reactor *r, const struct mail_header *header, const char *payload) {
+	if (header->type == MAIL_BROADCAST || header->type == MAIL_TILE_UPDATES) {
+		struct mg_shared *legacy = NULL; // The batch as RES_TILE_UPDATE messages, made for the first legacy_canvas user
+		struct ilist_node *node = NULL;
+		ilist_foreach(node, r->sockets) {
+			struct user *user = ilist_entry(node, struct user, reactor_node);
+			if (header->type == MAIL_TILE_UPDATES && user->is_subscribed) continue; // See deliver_filtered_updates()
+			if (header->type == MAIL_TILE_UPDATES && !is_keeping_up(r, user)) continue;
+			struct mg_connection *socket = user->socket;
+			if (header->type == MAIL_TILE_UPDATES && user->legacy_canvas) {
+				struct mg_str data = mg_ws_shared_data(header->frame);
+				if (!legacy) legacy = legacy_tile_updates((const uint8_t *)data.ptr, data.len);
+				mg_send_shared(socket, legacy);
+				continue;
+			}
+			switch (mg_ws_deflate_mode(socket)) {
+			case MG_WS_DEFLATE_OWN:
+			{
+				// Compresses with its own context, so it can't use the shared frame
+				struct mg_str data = mg_ws_shared_data(header->frame);
+				mg_ws_send(socket, data.ptr, data.len, header->op);
+				break;
+			}
+			case MG_WS_DEFLATE_SHARED:
+				mg_send_shared(socket, header->deflated ? header->deflated : header->frame);
+				break;
+			default:
+				mg_send_shared(socket, header->frame);
+				break;
+			}
+		}
+		if (header->type == MAIL_TILE_UPDATES && r->subscribed_count) deliver_filtered_updates(r, header->frame);
+		if (header->type == MAIL_TILE_UPDATES) r->delivered_seq = tile_updates_end_seq(mg_ws_shared_data(header->frame));
+		mg_shared_unref(legacy);
+		mg_shared_unref(header->frame);
+		if (header->deflated) mg_shared_unref(header->deflated);
+	} else if (header->type == MAIL_KICK) {
+		struct mg_connection *socket = find_connection(r, header->conn_id);
+		// Already gone, if not, and then its save is already queued
+		if (socket) {
+			mg_ws_send(socket, payload, header->len, header->op);
+			drop_user_with_connection(r->canvas, socket);
+		}
+		if (header->then) queue_db_job(r->canvas, header->then);
+	} else if (header->type == MAIL_AUTH) {
+		struct auth_reply reply;
+		memcpy(&reply, payload, sizeof(reply));
+		struct mg_iobuf held = stop_auth(r, header->conn_id);
+		struct mg_connection *socket = find_connection(r, header->conn_id);
+		if (!socket) {
+			mg_iobuf_free(&held);
+			return;
+		}
+		cJSON *response = finish_auth(r->canvas, socket, &reply);
+		char *str = cJSON_PrintUnformatted(response);
+		if (str) mg_ws_send(socket, str, strlen(str), WEBSOCKET_OP_TEXT);
+		free(str);
+		cJSON_Delete(response);
+		replay_held_messages(r, socket, &held);
+	} else if (header->type == MAIL_REPLY) {
+		struct mg_connection *socket = find_connection(r, header->conn_id);
+		if (socket) mg_ws_send(socket, payload, header->len, header->op);
+	} else if (header->type == MAIL_SET_NAME) {
+		struct name_reply reply;
+		memcpy(&reply, payload, sizeof(reply));
+		struct mg_connection *socket = find_connection(r, header->conn_id);
+		struct user *user = socket ? conn_user(socket) : NULL;
+		if (!user || !str_eq(user->uuid, reply.uuid)) return; // Stored, it gets it on the next auth
+		memcpy(user->user_name, reply.name, sizeof(user->user_name));
+		cJSON *response = base_response("nameSetSuccess");
+		send_json(response, user);
+		cJSON_Delete(response);
+	} else if (header->type == MAIL_SHADOW_BAN) {
+		struct ban_notice notice;
+		memcpy(&notice, payload, sizeof(notice));
+		pthread_rwlock_rdlock(&r->canvas->users_lock);
+		struct user *user = find_in_connected_users(r->canvas, notice.uuid);
+		// Ours, the others are told too
+		if (user && conn_reactor(user->socket) == r) user->is_shadow_banned = notice.is_shadow_banned;
+		pthread_rwlock_unlock(&r->canvas->users_lock);
+	}
+}
+
+void drain_mailbox(struct reactor *r) {
+	struct mg_iobuf mail = { 0 };
+	pthread_mutex_lock(&r->mailbox_lock);
+	mail = r->mailbox;
+	r->mailbox = (struct mg_iobuf){ 0 };
+	pthread_mutex_unlock(&r->mailbox_lock);
+	size_t offset = 0;
+	while (offset + sizeof(struct mail_header) <= mail.len) {
+		struct mail_header header;
+		memcpy(&header, mail.buf + offset, sizeof(header));
+		offset += sizeof(header);
+		deliver_mail(r, &header, (const char *)mail.buf + offset);
+		offset += header.len;
 	}
+	mg_iobuf_free(&mail);
+}
+
+static void mailbox_fn(struct mg_connection *c, int event_type, void *event_data, void *arg) {
+	(void)event_data;
+	if (event_type != MG_EV_READ) return;
+	c->recv.len = 0; // Just wakeup pokes
+	drain_mailbox((struct reactor *)arg);
 }
 
 void start_transaction(sqlite3 *db) {
@@ -1704,34 +3810,108 @@ void commit_transaction(sqlite3 *db) {
 	sqlite3_finalize(et);
 }
 
+// One coarse tick per reactor tells its users about regenerated tiles, instead of a timer per user
+static void tile_regen_timer_fn(void *arg) {
+	struct reactor *reactor = (struct reactor *)arg;
+	uint64_t now_unix = (unsigned)time(NULL);
+	struct ilist_node *node = NULL;
+	ilist_foreach(node, reactor->sockets) {
+		struct user *user = ilist_entry(node, struct user, reactor_node);
+		regen_tiles(user, now_unix);
+		if (!user->unsent_tiles) continue;
+		uint8_t added = user->unsent_tiles > 255 ? 255 : user->unsent_tiles;
+		char response[2];
+		response[0] = RES_TILE_INCREMENT;
+		response[1] = added;
+		mg_ws_send(user->socket, response, 2, WEBSOCKET_OP_BINARY);
+		user->unsent_tiles -= added;
+	}
+}
+
+// Each reactor saves the users it owns, by handing copies of them to the db thread.
+// Inactive ones are kicked by their idle_timer.
 static void users_save_timer_fn(void *arg) {
-	struct canvas *canvas = (struct canvas *)arg;
-	size_t users = list_elems(&canvas->connected_users);
-	if (!users) return;
-	start_transaction(canvas->backing_db);
-	struct list_elem *elem = NULL;
-	list_foreach_ro(elem, canvas->connected_users) {
-		struct user *user = (struct user *)elem->thing;
-		save_user(canvas, user);
+	struct reactor *reactor = (struct reactor *)arg;
+	struct canvas *canvas = reactor->canvas;
+	size_t count = 0;
+	struct ilist_node *node = NULL;
+	ilist_foreach(node, reactor->sockets) {
+		count++;
+	}
+	if (!count) return;
+	struct db_job *job = calloc(1, sizeof(*job));
+	job->type = DB_SAVE_USERS;
+	job->save.users = malloc(count * sizeof(*job->save.users));
+	ilist_foreach(node, reactor->sockets) {
+		struct user *user = ilist_entry(node, struct user, reactor_node);
+		job->save.users[job->save.count++] = *user;
 	}
-	commit_transaction(canvas->backing_db);
+	queue_db_job(canvas, job);
+}
 
-	// Check and kick inactive users
-	uint64_t current_time_unix = (unsigned)time(NULL);
-	list_foreach(canvas->connected_users, {
-		struct user *user = (struct user *)arg;
-		size_t sec_since_last_event = current_time_unix - user->last_event_unix;
-		if (sec_since_last_event > canvas->settings.kick_inactive_after_sec) {
-			logr("Kicking inactive user %s\n", user->uuid);
-			kick_with_message(canvas, user, "You haven't drawn anything for a while, so you were disconnected.", "Reconnect");
-		}
-	});
+void save_tile(struct canvas *canvas, sqlite3_stmt *insert, size_t i) {
+	sqlite3 *db = canvas->backing_db;
+	size_t x = i % canvas->edge_length;
+	size_t y = i / canvas->edge_length;
+	char last_modifier[UUID_STR_LEN + 1];
+	uuid_for_id(canvas, __atomic_load_n(&canvas->tile_modifiers[i], __ATOMIC_RELAXED), last_modifier);
+	int idx = 1;
+	int ret = sqlite3_bind_int(insert, idx++, __atomic_load_n(&canvas->tile_colors[i], __ATOMIC_ACQUIRE));
+	if (ret != SQLITE_OK) printf("Failed to bind colorID: %s\n", sqlite3_errmsg(db));
+	ret = sqlite3_bind_text(insert, idx++, last_modifier, -1, SQLITE_TRANSIENT);
+	if (ret != SQLITE_OK) printf("Failed to bind lastModifier: %s\n", sqlite3_errmsg(db));
+	ret = sqlite3_bind_int64(insert, idx++, __atomic_load_n(&canvas->tile_place_times[i], __ATOMIC_RELAXED));
+	if (ret != SQLITE_OK) printf("Failed to bind placeTime: %s\n", sqlite3_errmsg(db));
+	ret = sqlite3_bind_int(insert, idx++, x);
+	if (ret != SQLITE_OK) printf("Failed to bind X: %s\n", sqlite3_errmsg(db));
+	ret = sqlite3_bind_int(insert, idx++, y);
+	if (ret != SQLITE_OK) printf("Failed to bind Y: %s\n", sqlite3_errmsg(db));
+
+	int res = sqlite3_step(insert);
+	if (res != SQLITE_DONE) {
+		printf("Failed to UPDATE for x = %lu, y = %lu\n", x, y);
+		sqlite3_finalize(insert);
+		sqlite3_close(db);
+		exit(-1);
+	}
+	sqlite3_clear_bindings(insert);
+	sqlite3_reset(insert);
 }
 
-static void canvas_save_timer_fn(void *arg) {
-	struct canvas *canvas = (struct canvas *)arg;
+// Store the ids interned since the last save
+void save_uuid_table(struct canvas *canvas) {
+	struct uuid_table *t = &canvas->modifiers;
+	pthread_mutex_lock(&canvas->modifiers_lock);
+	if (t->stored_count >= t->count) goto out;
+	sqlite3 *db = canvas->backing_db;
+	sqlite3_stmt *insert;
+	int ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO user_ids (id, uuid) VALUES (?, ?)", -1, &insert, NULL);
+	if (ret != SQLITE_OK) {
+		printf("Failed to prepare user id insert: %s\n", sqlite3_errmsg(db));
+		sqlite3_finalize(insert);
+		goto out;
+	}
+	for (uint32_t id = t->stored_count ? t->stored_count : 1; id < t->count; ++id) {
+		sqlite3_bind_int64(insert, 1, id);
+		sqlite3_bind_text(insert, 2, t->uuids[id], -1, NULL);
+		if (sqlite3_step(insert) != SQLITE_DONE) {
+			printf("Failed to insert user id %u: %s\n", id, sqlite3_errmsg(db));
+			sqlite3_finalize(insert);
+			sqlite3_close(db);
+			exit(-1);
+		}
+		sqlite3_clear_bindings(insert);
+		sqlite3_reset(insert);
+	}
+	sqlite3_finalize(insert);
+	t->stored_count = t->count;
+out:
+	pthread_mutex_unlock(&canvas->modifiers_lock);
+}
 
-	if (!canvas->dirty) return;
+void save_canvas(struct canvas *canvas) {
+	// Cleared up front, tiles placed while saving make it dirty again
+	if (!__atomic_exchange_n(&canvas->dirty, false, __ATOMIC_ACQUIRE)) return;
 
 	struct timeval timer;
 	gettimeofday(&timer, NULL);
@@ -1747,35 +3927,20 @@ static void canvas_save_timer_fn(void *arg) {
 		goto bail;
 	}
 
-	logr("Saving canvas to disk (%li events) ", list_elems(&canvas->delta));
+	logr("Saving canvas to disk (%li tiles) ", __atomic_exchange_n(&canvas->dirty_tiles, 0, __ATOMIC_RELAXED));
 
-	struct list_elem *elem = NULL;
-	list_foreach_ro(elem, canvas->delta) {
-		struct tile_placement *p = (struct tile_placement *)elem->thing;
-		int idx = 1;
-		struct tile *tile = &p->tile;
-		ret = sqlite3_bind_int(insert, idx++, tile->color_id);
-		if (ret != SQLITE_OK) printf("Failed to bind colorID: %s\n", sqlite3_errmsg(db));
-		ret = sqlite3_bind_text(insert, idx++, tile->last_modifier, sizeof(tile->last_modifier), NULL);
-		if (ret != SQLITE_OK) printf("Failed to bind lastModifier: %s\n", sqlite3_errmsg(db));
-		ret = sqlite3_bind_int64(insert, idx++, tile->place_time_unix);
-		if (ret != SQLITE_OK) printf("Failed to bind placeTime: %s\n", sqlite3_errmsg(db));
-		ret = sqlite3_bind_int(insert, idx++, p->x);
-		if (ret != SQLITE_OK) printf("Failed to bind X: %s\n", sqlite3_errmsg(db));
-		ret = sqlite3_bind_int(insert, idx++, p->y);
-		if (ret != SQLITE_OK) printf("Failed to bind Y: %s\n", sqlite3_errmsg(db));
-
-		int res = sqlite3_step(insert);
-		if (res != SQLITE_DONE) {
-			printf("Failed to UPDATE for x = %lu, y = %lu\n", p->x, p->y);
-			sqlite3_finalize(insert);
-			sqlite3_close(db);
-			exit(-1);
+	save_uuid_table(canvas);
+
+	size_t words = (canvas->edge_length * canvas->edge_length + 63) / 64;
+	for (size_t w = 0; w < words; ++w) {
+		if (!__atomic_load_n(&canvas->dirty_bitmap[w], __ATOMIC_RELAXED)) continue;
+		// Tiles placed while saving go to the next save
+		uint64_t bits = __atomic_exchange_n(&canvas->dirty_bitmap[w], 0, __ATOMIC_ACQUIRE);
+		while (bits) {
+			save_tile(canvas, insert, w * 64 + __builtin_ctzll(bits));
+			bits &= bits - 1;
 		}
-		sqlite3_clear_bindings(insert);
-		sqlite3_reset(insert);
 	}
-	list_destroy(&canvas->delta);
 
 bail:
 	sqlite3_finalize(insert);
@@ -1783,9 +3948,236 @@ bail:
 	commit_transaction(db);
 	long ms = get_ms_delta(timer);
 	printf("(%lims)\n", ms);
-	canvas->dirty = false;
 }
 
+void log_backpressure_stats(struct canvas *canvas) {
+	struct backpressure_stats *stats = &canvas->backpressure;
+	size_t fell_behind = __atomic_exchange_n(&stats->fell_behind, 0, __ATOMIC_RELAXED);
+	size_t skipped = __atomic_exchange_n(&stats->updates_skipped, 0, __ATOMIC_RELAXED);
+	size_t resyncs = __atomic_exchange_n(&stats->resyncs, 0, __ATOMIC_RELAXED);
+	if (!fell_behind && !skipped && !resyncs) return;
+	logr("Slow clients: %lu fell behind, %lu tile updates skipped, %lu resynced\n", fell_behind, skipped, resyncs);
+}
+
+// Tiles are read atomically, so the db thread saves them while they keep getting placed
+static void canvas_save_timer_fn(void *arg) {
+	struct canvas *canvas = (struct canvas *)arg;
+	struct db_job *job = calloc(1, sizeof(*job));
+	job->type = DB_SAVE_CANVAS;
+	queue_db_job(canvas, job);
+	log_backpressure_stats(canvas);
+}
+
+// db thread
+
+// Replies go back to connection, on the reactor that owns it
+static struct db_job *db_job_for(struct mg_connection *connection, enum db_job_type type) {
+	struct db_job *job = calloc(1, sizeof(*job));
+	job->type = type;
+	job->reply_to = conn_reactor(connection);
+	job->conn_id = connection->id;
+	return job;
+}
+
+static void queue_db_job(struct canvas *c, struct db_job *job) {
+	struct db_queue *q = &c->db;
+	pthread_mutex_lock(&q->lock);
+	if (q->last) q->last->next = job;
+	else q->first = job;
+	q->last = job;
+	pthread_cond_signal(&q->job_ready);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Takes ownership of response
+static void reply_json(const struct db_job *job, cJSON *response) {
+	char *str = cJSON_PrintUnformatted(response);
+	if (str) post_mail(job->reply_to, MAIL_REPLY, job->conn_id, NULL, NULL, str, strlen(str), WEBSOCKET_OP_TEXT);
+	free(str);
+	cJSON_Delete(response);
+}
+
+static void reply_auth(const struct db_job *job, struct auth_reply *reply) {
+	reply->legacy_canvas = job->auth.legacy_canvas;
+	reply->codec = job->auth.codec;
+	post_mail(job->reply_to, MAIL_AUTH, job->conn_id, NULL, NULL, (const char *)reply, sizeof(*reply), WEBSOCKET_OP_TEXT);
+}
+
+static void db_initial_auth(struct canvas *c, const struct db_job *job) {
+	struct auth_reply reply = { .is_new = true };
+	struct remote_host *host = job->auth.has_addr ? find_host(c, job->auth.addr) : NULL;
+	if (host) {
+		char ip_buf[50];
+		mg_ntoa(&host->addr, ip_buf, sizeof(ip_buf));
+		logr("Received initialAuth from %s\n", ip_buf);
+		host->total_accounts++;
+		host->dirty = true;
+		if (host->total_accounts > c->settings.max_users_per_ip) {
+			logr("Rejecting initialAuth from %s, reached maximum of %li users\n", ip_buf, c->settings.max_users_per_ip);
+			reply.error = "Maximum users reached for this IP (contact vkoskiv if you think this is an issue)";
+			reply_auth(job, &reply);
+			return;
+		}
+	} else {
+		logr("Warning: No host given to handle_initial_auth. Maybe fix this probably.\n");
+	}
+
+	reply.user = (struct user){
+		.user_name = "Anonymous",
+		.remaining_tiles = 60,
+		.max_tiles = 250,
+		.tile_regen_seconds = 10,
+		.total_tiles_placed = 0,
+		.tiles_to_next_level = 100,
+		.current_level_progress = 0,
+		.level = 1,
+		.last_connected_unix = 0,
+		.last_regen_unix = (unsigned)time(NULL),
+	};
+	generate_uuid(reply.user.uuid);
+	add_user(c, &reply.user);
+	reply_auth(job, &reply);
+}
+
+static void db_auth(struct canvas *c, const struct db_job *job) {
+	struct auth_reply reply = { 0 };
+	struct user *user = try_load_user(c, job->uuid);
+	if (user) {
+		reply.user = *user;
+		free(user);
+	} else {
+		reply.error = "Invalid userID";
+	}
+	reply_auth(job, &reply);
+}
+
+static void db_tile_info(struct canvas *c, const struct db_job *job) {
+	struct user *user = try_load_user(c, job->uuid);
+	if (!user) {
+		reply_json(job, error_response("Couldn't find a user who modified that tile."));
+		return;
+	}
+	cJSON *response = base_response("ti");
+	cJSON_AddStringToObject(response, "un", user->user_name);
+	cJSON_AddNumberToObject(response, "pt", job->place_time);
+	free(user);
+	reply_json(job, response);
+}
+
+static void db_set_name(struct canvas *c, const struct db_job *job) {
+	if (nick_taken(c->backing_db, job->name)) {
+		reply_json(job, error_response("Nickname already taken"));
+		return;
+	}
+	logr("User %s set their username to %s\n", job->uuid, job->name);
+	store_user_name(c, job->uuid, job->name);
+	struct name_reply reply = { 0 };
+	memcpy(reply.uuid, job->uuid, sizeof(reply.uuid));
+	memcpy(reply.name, job->name, sizeof(reply.name));
+	post_mail(job->reply_to, MAIL_SET_NAME, job->conn_id, NULL, NULL, (const char *)&reply, sizeof(reply), WEBSOCKET_OP_TEXT);
+}
+
+static void db_shadow_ban(struct canvas *c, const struct db_job *job) {
+	struct user *user = try_load_user(c, job->uuid);
+	if (!user) {
+		reply_json(job, error_response(job->ban.toggle ? "No user found with that uuid" : "Couldn't find a user who modified that tile."));
+		return;
+	}
+	bool was_banned = user->is_shadow_banned;
+	free(user);
+	if (!job->ban.toggle && was_banned) {
+		reply_json(job, error_response("Already shadowbanned from there"));
+		return;
+	}
+	struct ban_notice notice = { .is_shadow_banned = job->ban.toggle ? !was_banned : true };
+	memcpy(notice.uuid, job->uuid, sizeof(notice.uuid));
+	if (job->ban.toggle) {
+		logr("Setting is_shadow_banned to %s for user %s\n", notice.is_shadow_banned ? "true" : "false", job->uuid);
+	} else {
+		logr("User %s shadowbanned from (%4lu,%4lu)\n", job->uuid, job->ban.x, job->ban.y);
+	}
+	store_shadow_ban(c, job->uuid, notice.is_shadow_banned);
+	// Whichever reactor has it connected takes it from here
+	for (size_t i = 0; i < c->reactor_count; ++i) {
+		post_mail(&c->reactors[i], MAIL_SHADOW_BAN, 0, NULL, NULL, (const char *)&notice, sizeof(notice), WEBSOCKET_OP_TEXT);
+	}
+	reply_json(job, base_response(job->ban.toggle ? "Success" : "ban_click_success"));
+}
+
+// Returns false once it's told to stop
+static bool run_db_job(struct canvas *c, const struct db_job *job) {
+	switch (job->type) {
+		case DB_SAVE_USERS:
+			start_transaction(c->backing_db);
+			for (size_t i = 0; i < job->save.count; ++i) {
+				save_user(c, &job->save.users[i]);
+			}
+			commit_transaction(c->backing_db);
+			break;
+		case DB_AUTH:         db_auth(c, job); break;
+		case DB_INITIAL_AUTH: db_initial_auth(c, job); break;
+		case DB_TILE_INFO:    db_tile_info(c, job); break;
+		case DB_SET_NAME:     db_set_name(c, job); break;
+		case DB_SHADOW_BAN:   db_shadow_ban(c, job); break;
+		case DB_SAVE_CANVAS:
+			save_canvas(c);
+			start_transaction(c->backing_db);
+			save_hosts(c);
+			commit_transaction(c->backing_db);
+			break;
+		case DB_RESIZE_HOSTS:
+			host_cache_resize(&c->hosts, c->settings.max_cached_hosts);
+			evict_hosts(c);
+			break;
+		case DB_BACKUP:       do_db_backup(c); break;
+		case DB_STOP:         return false;
+	}
+	return true;
+}
+
+static void *db_thread(void *arg) {
+	struct canvas *c = (struct canvas *)arg;
+	struct db_queue *q = &c->db;
+	bool running = true;
+	while (running) {
+		pthread_mutex_lock(&q->lock);
+		while (!q->first) pthread_cond_wait(&q->job_ready, &q->lock);
+		struct db_job *job = q->first;
+		q->first = job->next;
+		if (!q->first) q->last = NULL;
+		pthread_mutex_unlock(&q->lock);
+		running = run_db_job(c, job);
+		if (job->type == DB_SAVE_USERS) free(job->save.users);
+		free(job);
+	}
+	return NULL;
+}
+
+// From here on, only the db thread touches backing_db and the host cache
+void start_db_thread(struct canvas *c) {
+	pthread_mutex_init(&c->db.lock, NULL);
+	pthread_cond_init(&c->db.job_ready, NULL);
+	if (pthread_create(&c->db.thread, NULL, db_thread, c)) {
+		logr("Failed to start db thread\n");
+		exit(-1);
+	}
+	pthread_setname_np(c->db.thread, "Database");
+	c->db.started = true;
+}
+
+// Everything queued before this still gets done
+void stop_db_thread(struct canvas *c) {
+	struct db_job *job = calloc(1, sizeof(*job));
+	job->type = DB_STOP;
+	queue_db_job(c, job);
+	pthread_join(c->db.thread, NULL);
+	c->db.started = false;
+	pthread_cond_destroy(&c->db.job_ready);
+	pthread_mutex_destroy(&c->db.lock);
+}
+
+// end db thread
+
 void ensure_tiles_table(sqlite3 *db, size_t edge_length) {
 	// Next, ensure we've got tiles in there.
 	sqlite3_stmt *count;
@@ -1874,25 +4266,46 @@ bool load_tiles(struct canvas *c) {
 	c->edge_length = sqrt(rows);
 	sqlite3_finalize(count_query);
 
-	c->tiles = calloc(c->edge_length * c->edge_length, sizeof(struct tile));
-	c->connected_users = LIST_INITIALIZER;
-	c->connected_hosts = LIST_INITIALIZER;
+	c->tile_colors = calloc(c->edge_length * c->edge_length, sizeof(*c->tile_colors));
+	c->tile_place_times = calloc(c->edge_length * c->edge_length, sizeof(*c->tile_place_times));
+	c->tile_modifiers = calloc(c->edge_length * c->edge_length, sizeof(*c->tile_modifiers));
+	c->pending_bitmap = calloc((c->edge_length * c->edge_length + 7) / 8, 1);
+	c->dirty_bitmap = calloc((c->edge_length * c->edge_length + 63) / 64, sizeof(uint64_t));
+	init_canvas_chunks(c);
+	c->update_history = calloc(c->settings.tile_update_history, sizeof(*c->update_history));
+	// Random, so sequence numbers clients kept from before a restart are unlikely to mean anything now
+	mg_random(&c->update_seq, sizeof(c->update_seq));
+	c->host_pool = POOL_INITIALIZER(struct remote_host);
+	uuid_index_init(&c->user_index, UUID_STR_LEN);
+	uuid_index_init(&c->modifiers.index, UUID_STR_LEN);
+	host_cache_init(&c->hosts, c->settings.max_cached_hosts);
 	printf("Loading %ux%u canvas...\n", c->edge_length, c->edge_length);
 
 	sqlite3_stmt *query;
+	sqlite3_prepare_v2(c->backing_db, "SELECT id, uuid FROM user_ids", -1, &query, NULL);
+	while (sqlite3_step(query) == SQLITE_ROW) {
+		uint32_t id = sqlite3_column_int64(query, 0);
+		const char *uuid = (const char *)sqlite3_column_text(query, 1);
+		if (id && uuid) uuid_table_set(&c->modifiers, id, uuid);
+	}
+	sqlite3_finalize(query);
+	c->modifiers.stored_count = c->modifiers.count;
+
 	sqlite3_prepare_v2(c->backing_db, "select * from tiles", -1, &query, NULL);
 
 	while (sqlite3_step(query) != SQLITE_DONE) {
 		int idx = 1;
 		size_t x = sqlite3_column_int(query, idx++);
 		size_t y = sqlite3_column_int(query, idx++);
-		c->tiles[x + y * c->edge_length].color_id = sqlite3_column_int(query, idx++);
-		const char *last_modifier = (const char *)sqlite3_column_text(query, idx++);
-		strncpy(c->tiles[x + y * c->edge_length].last_modifier, last_modifier, UUID_STR_LEN - 1);
-		c->tiles[x + y * c->edge_length].place_time_unix = sqlite3_column_int64(query, idx++);
+		size_t i = x + y * c->edge_length;
+		c->tile_colors[i] = sqlite3_column_int(query, idx++);
+		// Databases from before user_ids get their ids interned here, and stored on the next save
+		c->tile_modifiers[i] = intern_uuid(c, (const char *)sqlite3_column_text(query, idx++));
+		c->tile_place_times[i] = sqlite3_column_int64(query, idx++);
 	}
 	sqlite3_finalize(query);
-	c->dirty = false;
+	// Ids interned from an older database still need storing
+	c->dirty = c->modifiers.stored_count < c->modifiers.count;
 	return false;
 }
 
@@ -1945,6 +4358,84 @@ void start_worker_thread(struct canvas *c) {
 	if (ret < 0) printf("Oops\n");
 }
 
+// One iteration of a reactor's event loop
+static void reactor_poll(struct reactor *r) {
+	int ms = tile_update_poll_ms(r->canvas);
+	// Don't sleep through resync_timer_fn() while somebody is waiting on it
+	if (r->resyncs_pending && ms > RESYNC_INTERVAL_MS) ms = RESYNC_INTERVAL_MS;
+	mg_mgr_poll(&r->mgr, ms);
+	timer_wheel_advance(&r->wheel, mg_millis());
+	flush_tile_updates(r->canvas);
+}
+
+void *reactor_thread(void *arg) {
+	struct reactor *r = (struct reactor *)arg;
+	t_reactor = r;
+	while (g_running) {
+		reactor_poll(r);
+	}
+	return NULL;
+}
+
+// Reactor 0 runs on the main thread, the rest get their own threads.
+// They all listen on listen_url, and the kernel spreads connections between them.
+bool start_reactors(struct canvas *c) {
+	c->reactor_count = c->settings.reactor_threads;
+	c->reactors = calloc(c->reactor_count, sizeof(*c->reactors));
+	printf("Starting %lu WS listener(s) on %s/ws\n", c->reactor_count, c->settings.listen_url);
+	for (size_t i = 0; i < c->reactor_count; ++i) {
+		struct reactor *r = &c->reactors[i];
+		r->canvas = c;
+		r->idx = i;
+		r->user_pool = POOL_INITIALIZER(struct user);
+		r->sockets = ILIST_INITIALIZER;
+		pthread_mutex_init(&r->mailbox_lock, NULL);
+		pthread_mutex_init(&r->pending_lock, NULL);
+		mg_mgr_init(&r->mgr);
+		r->mgr.userdata = r;
+		r->mgr.ws_deflate = c->settings.ws_deflate;
+		r->mgr.ws_deflate_takeover = c->settings.ws_deflate_context_takeover;
+		// Only needed for the reactors to share the address, a lone one shouldn't take over a port still in use
+		r->mgr.reuseport = c->reactor_count > 1;
+		r->delivered_seq = c->update_seq;
+		r->wakeup_fd = mg_mkpipe(&r->mgr, mailbox_fn, r);
+		if (r->wakeup_fd < 0) {
+			printf("Failed to create wakeup pipe for reactor %lu\n", i);
+			return true;
+		}
+		timer_wheel_init(&r->wheel, mg_millis());
+		mg_timer_add(&r->mgr, 1000 * c->settings.users_save_interval_sec, MG_TIMER_REPEAT, users_save_timer_fn, r);
+		mg_timer_add(&r->mgr, RESYNC_INTERVAL_MS, MG_TIMER_REPEAT, resync_timer_fn, r);
+		mg_timer_add(&r->mgr, 1000, MG_TIMER_REPEAT, tile_regen_timer_fn, r);
+		if (i == 0) mg_timer_add(&r->mgr, 1000 * c->settings.canvas_save_interval_sec, MG_TIMER_REPEAT, canvas_save_timer_fn, c);
+		if (!mg_http_listen(&r->mgr, c->settings.listen_url, callback_fn, NULL)) {
+			printf("Failed to listen on %s for reactor %lu\n", c->settings.listen_url, i);
+			return true;
+		}
+	}
+	c->reactors[0].thread = pthread_self();
+	t_reactor = &c->reactors[0];
+	for (size_t i = 1; i < c->reactor_count; ++i) {
+		struct reactor *r = &c->reactors[i];
+		if (pthread_create(&r->thread, NULL, reactor_thread, r)) {
+			printf("Failed to start reactor thread %lu\n", i);
+			return true;
+		}
+		char name[16];
+		snprintf(name, sizeof(name), "Reactor%u", (uint16_t)i);
+		pthread_setname_np(r->thread, name);
+	}
+	return false;
+}
+
+void stop_reactors(struct canvas *c) {
+	for (size_t i = 1; i < c->reactor_count; ++i) {
+		struct reactor *r = &c->reactors[i];
+		send(r->wakeup_fd, "", 1, MSG_DONTWAIT);
+		pthread_join(r->thread, NULL);
+	}
+}
+
 int main(void) {
 	setbuf(stdout, NULL); // Disable output buffering
 
@@ -1963,6 +4454,17 @@ int main(void) {
 	pidfile_write(pfh);
 
 	struct canvas canvas = (struct canvas){ 0 };
+	pthread_rwlock_init(&canvas.users_lock, NULL);
+	pthread_mutex_init(&canvas.config_lock, NULL);
+	pthread_mutex_init(&canvas.chunks_lock, NULL);
+	pthread_mutex_init(&canvas.modifiers_lock, NULL);
+	pthread_mutex_init(&canvas.broadcast_lock, NULL);
+	pthread_mutex_init(&canvas.worker_lock, NULL);
+	pthread_condattr_t cond_attribs;
+	pthread_condattr_init(&cond_attribs);
+	pthread_condattr_setclock(&cond_attribs, CLOCK_MONOTONIC);
+	pthread_cond_init(&canvas.canvas_changed, &cond_attribs);
+	pthread_condattr_destroy(&cond_attribs);
 	load_config(&canvas);
 
 	if (signal(SIGINT, sig_handler) == SIG_ERR) {
@@ -1987,51 +4489,108 @@ int main(void) {
 		return -1;
 	}
 
-	mg_mgr_init(&canvas.mgr);
-	//ws ping loop. TODO: Probably do this from the client side instead.
-	mg_timer_add(&canvas.mgr, 1000 * canvas.settings.websocket_ping_interval_sec, MG_TIMER_REPEAT, ping_timer_fn, &canvas.mgr);
-	mg_timer_add(&canvas.mgr, 1000 * canvas.settings.canvas_save_interval_sec, MG_TIMER_REPEAT, canvas_save_timer_fn, &canvas);
-	mg_timer_add(&canvas.mgr, 1000 * canvas.settings.users_save_interval_sec, MG_TIMER_REPEAT, users_save_timer_fn, &canvas);
-	printf("Starting WS listener on %s/ws\n", canvas.settings.listen_url);
-	mg_http_listen(&canvas.mgr, canvas.settings.listen_url, callback_fn, &canvas);
+	// Threads started below inherit this mask, so signals land on this thread and
+	// interrupt reactor 0's poll instead of waiting out its timeout
+	sigset_t handled, old_mask;
+	sigemptyset(&handled);
+	sigaddset(&handled, SIGINT);
+	sigaddset(&handled, SIGTERM);
+	sigaddset(&handled, SIGUSR1);
+	sigaddset(&handled, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &handled, &old_mask);
+
 	// Set up canvas cache and start a background worker to refresh it
-	update_getcanvas_cache(&canvas);
+	start_compress_threads(&canvas);
+	struct timeval tmr;
+	gettimeofday(&tmr, NULL);
+	snapshot_dirty_chunks(&canvas);
+	// Nobody is connected yet, but most will want this one
+	refresh_canvas_caches(&canvas, (bool[CANVAS_FORMAT_COUNT]){ [CODEC_DEFAULT] = true });
+	logr("Compressed canvas with %lu thread(s) in %lums\n", canvas.settings.compress_threads, get_ms_delta(tmr));
 	start_worker_thread(&canvas);
+	start_db_thread(&canvas);
+	if (start_reactors(&canvas)) {
+		printf("Failed to start reactors\n");
+		return -1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
 	while (g_running) {
 		if (g_reload_config) {
 			load_config(&canvas);
 			g_reload_config = false;
 		}
 		if (g_do_db_backup) {
-			do_db_backup(&canvas);
+			struct db_job *job = calloc(1, sizeof(*job));
+			job->type = DB_BACKUP;
+			queue_db_job(&canvas, job);
 			g_do_db_backup = false;
 		}
-		mg_mgr_poll(&canvas.mgr, 1000);
+		reactor_poll(&canvas.reactors[0]);
 	}
+	// From here on, everything runs on this thread.
+	stop_reactors(&canvas);
+	pthread_mutex_lock(&canvas.worker_lock);
+	canvas.worker_stop = true;
+	pthread_cond_signal(&canvas.canvas_changed);
+	pthread_mutex_unlock(&canvas.worker_lock);
+	pthread_join(canvas.canvas_worker_thread, NULL);
+	stop_compress_threads(&canvas);
+	canvas.settings.tile_update_interval_ms = 0;
+	flush_tile_updates(&canvas);
 
 	cJSON *response = base_response("disconnecting");
 	broadcast(&canvas, response);
 	cJSON_Delete(response);
+	for (size_t i = 0; i < canvas.reactor_count; ++i) {
+		drain_mailbox(&canvas.reactors[i]);
+	}
 	drop_all_connections(&canvas);
 
 	//FIXME: Hack. Just flush some events before closing
 	for (size_t i = 0; i < 100; ++i) {
-		mg_mgr_poll(&canvas.mgr, 1);
+		for (size_t r = 0; r < canvas.reactor_count; ++r) {
+			mg_mgr_poll(&canvas.reactors[r].mgr, 1);
+		}
 	}
 	logr("Saving canvas one more time...\n");
 	canvas_save_timer_fn(&canvas);
-	logr("Saving users...\n");
-	users_save_timer_fn(&canvas);
+	// The users got queued for saving as they were dropped, all of that is done before it stops
+	stop_db_thread(&canvas);
 
 	printf("Closing db\n");
-	mg_mgr_free(&canvas.mgr);
-	free(canvas.tiles);
+	for (size_t i = 0; i < canvas.reactor_count; ++i) {
+		struct reactor *r = &canvas.reactors[i];
+		mg_mgr_free(&r->mgr);
+		mg_iobuf_free(&r->mailbox);
+		mg_iobuf_free(&r->pending_updates);
+		mg_iobuf_free(&r->authing);
+		mg_iobuf_free(&r->held);
+		for (size_t i = 0; r->subscribers && i < (size_t)canvas.levels[0].chunks_per_edge * canvas.levels[0].chunks_per_edge; ++i) {
+			free(r->subscribers[i].users);
+		}
+		free(r->subscribers);
+		free(r->touched);
+		pool_destroy(&r->user_pool);
+		pthread_mutex_destroy(&r->mailbox_lock);
+		pthread_mutex_destroy(&r->pending_lock);
+	}
+	free(canvas.reactors);
+	free(canvas.tile_colors);
+	free(canvas.tile_place_times);
+	free(canvas.tile_modifiers);
+	free(canvas.modifiers.uuids);
+	uuid_index_destroy(&canvas.modifiers.index);
+	free(canvas.pending_bitmap);
+	mg_iobuf_free(&canvas.flushing);
+	free(canvas.update_history);
 	free(canvas.color_list.colors);
 	free(canvas.color_response_cache);
-	list_destroy(&canvas.connected_users);
-	list_destroy(&canvas.connected_hosts);
-	list_destroy(&canvas.administrators);
-	list_destroy(&canvas.delta);
+	uuid_index_destroy(&canvas.user_index);
+	host_cache_destroy(&canvas.hosts);
+	pool_destroy(&canvas.host_pool);
+	free(canvas.administrators);
+	free(canvas.dirty_bitmap);
+	free_canvas_chunks(&canvas);
 	sqlite3_close(canvas.backing_db);
 	pidfile_remove(pfh);
 	return 0;
@@ -0,0 +1,73 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fixed size object pool
+// Objects are carved out of slabs of POOL_SLAB_ITEMS, and freed ones are reused
+// before a new slab is allocated. Slabs are only returned by pool_destroy().
+// Not thread safe.
+
+#define POOL_SLAB_ITEMS 256
+#define POOL_ALIGN 16 // What malloc() gives us
+#define _POOL_ROUND_UP(n) (((n) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN)
+
+struct pool_slab {
+	struct pool_slab *next;
+	// Followed by POOL_SLAB_ITEMS items
+};
+
+struct pool {
+	size_t item_size;
+	size_t in_use;
+	struct pool_slab *slabs;
+	void *free_items; // Each free item starts with a pointer to the next one
+};
+
+#define POOL_INITIALIZER(type) (struct pool){ .item_size = sizeof(type) < sizeof(void *) ? sizeof(void *) : sizeof(type) }
+
+static inline void _pool_grow(struct pool *pool) {
+	// Keep every item aligned like malloc() would
+	size_t stride = _POOL_ROUND_UP(pool->item_size);
+	size_t header = _POOL_ROUND_UP(sizeof(struct pool_slab));
+	struct pool_slab *slab = malloc(header + POOL_SLAB_ITEMS * stride);
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	char *items = (char *)slab + header;
+	// Thread the new items onto the free list, first one on top
+	for (size_t i = POOL_SLAB_ITEMS; i-- > 0;) {
+		void *item = items + i * stride;
+		*(void **)item = pool->free_items;
+		pool->free_items = item;
+	}
+}
+
+// Zeroed, like calloc
+static inline void *pool_alloc(struct pool *pool) {
+	if (!pool->free_items) _pool_grow(pool);
+	void *item = pool->free_items;
+	pool->free_items = *(void **)item;
+	pool->in_use++;
+	memset(item, 0, pool->item_size);
+	return item;
+}
+
+static inline void pool_free(struct pool *pool, void *item) {
+	if (!item) return;
+	*(void **)item = pool->free_items;
+	pool->free_items = item;
+	pool->in_use--;
+}
+
+static inline void pool_destroy(struct pool *pool) {
+	struct pool_slab *slab = pool->slabs;
+	while (slab) {
+		struct pool_slab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	pool->slabs = NULL;
+	pool->free_items = NULL;
+	pool->in_use = 0;
+}
+
+// end pool
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Hashed timer wheel
+// Arming and cancelling a timer is O(1), and each tick only looks at the
+// timers hashed into a single slot. Timers are intrusive and one-shot:
+// embed a struct wheel_timer in whatever owns it, and re-arm it from the
+// callback to get a repeating timer. Not thread safe, each wheel belongs
+// to one thread.
+
+#define WHEEL_SLOTS 1024 // Must be a power of two
+#define WHEEL_TICK_MS 100
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev; // NULL when not armed
+	uint64_t expire_tick;
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct timer_wheel {
+	uint64_t current_tick;
+	struct wheel_timer *cursor; // Next timer to visit while expiring a slot
+	struct wheel_timer *slots[WHEEL_SLOTS];
+};
+
+static inline void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms) {
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->current_tick = now_ms / WHEEL_TICK_MS;
+}
+
+static inline void wheel_timer_init(struct wheel_timer *timer, void (*fn)(void *arg), void *arg) {
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->expire_tick = 0;
+	timer->fn = fn;
+	timer->arg = arg;
+}
+
+static inline bool wheel_timer_armed(const struct wheel_timer *timer) {
+	return timer->pprev != NULL;
+}
+
+static inline void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer) {
+	if (!timer->pprev) return;
+	// Callbacks may cancel the timer we were about to visit next
+	if (wheel->cursor == timer) wheel->cursor = timer->next;
+	*timer->pprev = timer->next;
+	if (timer->next) timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+// (Re)arm timer to fire once, delay_ms from now, rounded up to a whole tick
+static inline void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t delay_ms) {
+	timer_wheel_cancel(wheel, timer);
+	uint64_t ticks = (delay_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+	timer->expire_tick = wheel->current_tick + (ticks ? ticks : 1);
+	struct wheel_timer **slot = &wheel->slots[timer->expire_tick & (WHEEL_SLOTS - 1)];
+	timer->next = *slot;
+	if (*slot) (*slot)->pprev = &timer->next;
+	*slot = timer;
+	timer->pprev = slot;
+}
+
+// Fire everything that expired by now_ms.
+// Timers further out than one lap share slots with nearer ones, and are skipped until their lap comes.
+static inline void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms) {
+	uint64_t target = now_ms / WHEEL_TICK_MS;
+	// After a long stall, one lap around the wheel is enough to catch up
+	if (target > wheel->current_tick + WHEEL_SLOTS) wheel->current_tick = target - WHEEL_SLOTS;
+	while (wheel->current_tick < target) {
+		wheel->current_tick++;
+		struct wheel_timer *timer = wheel->slots[wheel->current_tick & (WHEEL_SLOTS - 1)];
+		while (timer) {
+			wheel->cursor = timer->next;
+			if (timer->expire_tick <= wheel->current_tick) {
+				timer_wheel_cancel(wheel, timer);
+				timer->fn(timer->arg); // May free timer
+			}
+			timer = wheel->cursor;
+		}
+	}
+	wheel->cursor = NULL;
+}
+
+// end timer wheel
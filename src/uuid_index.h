@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Open addressing hash index from a uuid string to whatever owns it.
+// Keys are not copied, they must point into the value and stay put while indexed.
+// Keys compare like strncmp(a, b, key_len), so they don't need to be NUL terminated.
+// Linear probing, kept at most half full so misses stay short. Not thread safe.
+
+#define UUID_INDEX_MIN_CAPACITY 64 // Must be a power of two
+
+struct uuid_index_slot {
+	const char *key; // NULL when empty
+	void *value;
+};
+
+struct uuid_index {
+	size_t key_len;
+	size_t count;
+	size_t capacity;
+	struct uuid_index_slot *slots;
+};
+
+static inline void uuid_index_init(struct uuid_index *index, size_t key_len) {
+	memset(index, 0, sizeof(*index));
+	index->key_len = key_len;
+}
+
+static inline void uuid_index_destroy(struct uuid_index *index) {
+	free(index->slots);
+	uuid_index_init(index, index->key_len);
+}
+
+// FNV-1a
+static inline uint64_t _uuid_index_hash(const struct uuid_index *index, const char *key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < index->key_len && key[i]; ++i) {
+		hash ^= (uint8_t)key[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Slot holding key, or the empty slot where it would go
+static inline size_t _uuid_index_probe(const struct uuid_index *index, const char *key) {
+	size_t mask = index->capacity - 1;
+	size_t i = _uuid_index_hash(index, key) & mask;
+	while (index->slots[i].key && strncmp(index->slots[i].key, key, index->key_len) != 0) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static inline void _uuid_index_resize(struct uuid_index *index, size_t capacity) {
+	struct uuid_index_slot *old = index->slots;
+	size_t old_capacity = index->capacity;
+	index->slots = calloc(capacity, sizeof(*index->slots));
+	index->capacity = capacity;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		if (!old[i].key) continue;
+		index->slots[_uuid_index_probe(index, old[i].key)] = old[i];
+	}
+	free(old);
+}
+
+static inline void *uuid_index_find(const struct uuid_index *index, const char *key) {
+	if (!index->count) return NULL;
+	return index->slots[_uuid_index_probe(index, key)].value;
+}
+
+// Maps key to value, replacing whatever it mapped to before
+static inline void uuid_index_put(struct uuid_index *index, const char *key, void *value) {
+	if ((index->count + 1) * 2 > index->capacity) {
+		_uuid_index_resize(index, index->capacity ? index->capacity * 2 : UUID_INDEX_MIN_CAPACITY);
+	}
+	size_t i = _uuid_index_probe(index, key);
+	if (!index->slots[i].key) index->count++;
+	index->slots[i] = (struct uuid_index_slot){ .key = key, .value = value };
+}
+
+// Unmaps key, but only if it still maps to value. A newer session may have taken it over.
+static inline void uuid_index_remove(struct uuid_index *index, const char *key, const void *value) {
+	if (!index->count) return;
+	size_t mask = index->capacity - 1;
+	size_t hole = _uuid_index_probe(index, key);
+	if (!index->slots[hole].key || index->slots[hole].value != value) return;
+	index->slots[hole].key = NULL;
+	index->slots[hole].value = NULL;
+	index->count--;
+	// Shift later entries of the probe run back, so lookups never stop early at the hole
+	for (size_t i = (hole + 1) & mask; index->slots[i].key; i = (i + 1) & mask) {
+		size_t home = _uuid_index_hash(index, index->slots[i].key) & mask;
+		// Entries whose home lies cyclically in (hole, i] are already reachable
+		if (((i - home) & mask) < ((i - hole) & mask)) continue;
+		index->slots[hole] = index->slots[i];
+		index->slots[i].key = NULL;
+		index->slots[i].value = NULL;
+		hole = i;
+	}
+}
+
+// end uuid index
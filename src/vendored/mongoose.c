@@ -1970,6 +1970,33 @@ size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
   return len;
 }
 
+struct mg_shared *mg_shared_new(const void *buf, size_t len) {
+  struct mg_shared *s = (struct mg_shared *) calloc(1, sizeof(*s) + len);
+  if (s != NULL) {
+    s->refs = 1;
+    s->len = len;
+    if (buf != NULL) memcpy(s->buf, buf, len);
+  }
+  return s;
+}
+
+void mg_shared_ref(struct mg_shared *s) {
+#if defined(__GNUC__) || defined(__clang__)
+  __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+#else
+  s->refs++;
+#endif
+}
+
+void mg_shared_unref(struct mg_shared *s) {
+  if (s == NULL) return;
+#if defined(__GNUC__) || defined(__clang__)
+  if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) free(s);
+#else
+  if (--s->refs == 0) free(s);
+#endif
+}
+
 size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len) {
   if (ofs > io->len) ofs = io->len;
   if (ofs + len > io->len) len = io->len - ofs;
@@ -3501,6 +3528,21 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   return c;
 }
 
+// One entry in mg_connection::shared
+struct mg_shared_ref {
+  struct mg_shared *s;
+  size_t ofs;   // Bytes of s already sent
+  size_t mark;  // Bytes of c->send that have to go out before s
+};
+
+// Drop the first n bytes worth of shared buffer refs from the queue
+static void mg_shared_release(struct mg_connection *c, size_t n) {
+  struct mg_shared_ref *refs = (struct mg_shared_ref *) c->shared.buf;
+  size_t i;
+  for (i = 0; i < n / sizeof(*refs); i++) mg_shared_unref(refs[i].s);
+  mg_iobuf_del(&c->shared, 0, n);
+}
+
 void mg_close_conn(struct mg_connection *c) {
   mg_resolve_cancel(c);  // Close any pending DNS query
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
@@ -3514,6 +3556,9 @@ void mg_close_conn(struct mg_connection *c) {
   mg_tls_free(c);
   mg_iobuf_free(&c->recv);
   mg_iobuf_free(&c->send);
+  mg_shared_release(c, c->shared.len);
+  mg_iobuf_free(&c->shared);
+  mg_ws_deflate_free(c);
   memset(c, 0, sizeof(*c));
   free(c);
 }
@@ -3547,6 +3592,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   } else if (!mg_open_listener(c, url)) {
     MG_ERROR(("Failed: %s, errno %d", url, errno));
     free(c);
+    c = NULL;
   } else {
     c->is_listening = 1;
     c->is_udp = strncmp(url, "udp:", 4) == 0;
@@ -3566,6 +3612,13 @@ struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
     c->fd = (void *) (size_t) fd;
     c->fn = fn;
     c->fn_data = fn_data;
+#if MG_ENABLE_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+#endif
     mg_call(c, MG_EV_OPEN, NULL);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
   }
@@ -3579,15 +3632,29 @@ struct mg_timer *mg_timer_add(struct mg_mgr *mgr, uint64_t milliseconds,
   return t;
 }
 
+#if MG_ENABLE_EPOLL
+static void mg_epoll_ready(struct mg_connection *c);
+static void mg_epoll_poll_fn(void *arg);
+#endif
+
 void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
   struct mg_timer *tmp, *t = mgr->timers;
   while (t != NULL) tmp = t->next, free(t), t = tmp;
   mgr->timers = NULL;  // Important. Next call to poll won't touch timers
-  for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    c->is_closing = 1;
+#if MG_ENABLE_EPOLL
+    mg_epoll_ready(c);
+#endif
+  }
   mg_mgr_poll(mgr, 0);
 #if MG_ARCH == MG_ARCH_FREERTOS_TCP
   FreeRTOS_DeleteSocketSet(mgr->ss);
+#endif
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+  mgr->epoll_fd = -1;
 #endif
   MG_DEBUG(("All connections closed"));
 }
@@ -3604,6 +3671,12 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   // Ignore SIGPIPE signal, so if client cancels the request, it
   // won't kill the whole process.
   signal(SIGPIPE, SIG_IGN);
+#endif
+#if MG_ENABLE_EPOLL
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    MG_ERROR(("epoll_create1 errno %d", errno));
+  }
+  mg_timer_add(mgr, MG_EPOLL_POLL_MS, MG_TIMER_REPEAT, mg_epoll_poll_fn, mgr);
 #endif
   mgr->dnstimeout = 3000;
   mgr->dns4.url = "udp://8.8.8.8:53";
@@ -3944,6 +4017,67 @@ typedef int SOCKET;
 
 #define FD(c_) ((SOCKET) (size_t) (c_)->fd)
 #define S2PTR(s_) ((void *) (size_t) (s_))
+#define MG_SEND_PENDING(c_) ((c_)->send.len > 0 || (c_)->shared.len > 0)
+
+#if MG_ENABLE_EPOLL
+#if MG_ENABLE_MBEDTLS || MG_ENABLE_OPENSSL || MG_ENABLE_CUSTOM_TLS
+#error "MG_ENABLE_EPOLL does not support TLS"
+#endif
+
+// Sockets are registered once, when they are created. After that, only
+// EPOLLOUT interest is toggled, when the send buffer goes (non-)empty.
+static bool mg_wants_write(struct mg_connection *c) {
+  return c->is_connecting || (MG_SEND_PENDING(c) && c->is_tls_hs == 0);
+}
+
+static void mg_epoll_ctl(struct mg_connection *c, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if (c->is_epollout) ev.events |= EPOLLOUT;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, op, FD(c), &ev) != 0) {
+    MG_ERROR(("%lu epoll_ctl %d, errno %d", c->id, op, MG_SOCK_ERRNO));
+  }
+}
+
+static void mg_epoll_add(struct mg_connection *c) {
+  c->is_epollout = mg_wants_write(c);
+  mg_epoll_ctl(c, EPOLL_CTL_ADD);
+}
+
+static void mg_epoll_sync(struct mg_connection *c) {
+  bool want = mg_wants_write(c);
+  if (c->is_resolving || FD(c) == INVALID_SOCKET) return;
+  if (want == (bool) c->is_epollout) return;
+  c->is_epollout = want;
+  mg_epoll_ctl(c, EPOLL_CTL_MOD);
+}
+
+// mg_mgr_poll() only services connections on the ready list, instead of
+// walking all of them every time.
+static void mg_epoll_ready(struct mg_connection *c) {
+  if (c->is_ready) return;
+  c->is_ready = 1;
+  c->ready_next = c->mgr->ready;
+  c->mgr->ready = c;
+}
+
+// Walks all connections once every MG_EPOLL_POLL_MS for MG_EV_POLL, and
+// picks up the ones told to drain or close, or with data to send, from
+// outside their own event handler.
+static void mg_epoll_poll_fn(void *arg) {
+  struct mg_mgr *mgr = (struct mg_mgr *) arg;
+  struct mg_connection *c;
+  uint64_t now = mg_millis();
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    mg_call(c, MG_EV_POLL, &now);
+    if (c->is_draining || c->is_closing || MG_SEND_PENDING(c)) {
+      mg_epoll_ready(c);
+    }
+  }
+}
+#endif
 
 #ifndef MSG_NONBLOCKING
 #define MSG_NONBLOCKING 0
@@ -4078,8 +4212,33 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     iolog(c, (char *) buf, n, false);
     return n > 0;
   } else {
-    return mg_iobuf_add(&c->send, c->send.len, buf, len, MG_IO_SIZE);
+    size_t n = mg_iobuf_add(&c->send, c->send.len, buf, len, MG_IO_SIZE);
+#if MG_ENABLE_EPOLL
+    mg_epoll_sync(c);
+#endif
+    return n;
+  }
+}
+
+bool mg_send_shared(struct mg_connection *c, struct mg_shared *s) {
+  struct mg_shared_ref ref = {s, 0, c->send.len};
+  if (c->is_udp || c->is_tls || !MG_ENABLE_WRITEV) {
+    return mg_send(c, s->buf, s->len);  // Needs its own copy
+  } else if (!mg_iobuf_add(&c->shared, c->shared.len, &ref, sizeof(ref),
+                           MG_IO_SIZE)) {
+    return false;
   }
+  mg_shared_ref(s);
+  c->shared_pending += s->len;
+#if MG_ENABLE_EPOLL
+  mg_epoll_sync(c);
+#endif
+  return true;
+}
+
+// Bytes queued on c that haven't made it to the socket yet
+size_t mg_send_backlog(const struct mg_connection *c) {
+  return c->send.len + c->shared_pending;
 }
 
 static void mg_set_non_blocking_mode(SOCKET fd) {
@@ -4148,6 +4307,14 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       //    but won't work! (setsockopt will return EINVAL)
       MG_ERROR(("reuseaddr: %d", MG_SOCK_ERRNO));
 #endif
+#if defined(SO_REUSEPORT)
+    } else if (c->mgr->reuseport &&
+               setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on,
+                          sizeof(on)) != 0) {
+      // Lets several managers listen on the same address, with the kernel
+      // spreading incoming connections between them
+      MG_ERROR(("reuseport: %d", MG_SOCK_ERRNO));
+#endif
 #if MG_ARCH == MG_ARCH_WIN32 && !defined(SO_EXCLUSIVEADDRUSE) && !defined(WINCE)
     } else if (setsockopt(fd, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &on,
                           sizeof(on)) != 0) {
@@ -4165,6 +4332,9 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       setlocaddr(fd, &c->loc);
       mg_set_non_blocking_mode(fd);
       c->fd = S2PTR(fd);
+#if MG_ENABLE_EPOLL
+      mg_epoll_add(c);
+#endif
       success = true;
     }
   }
@@ -4205,10 +4375,79 @@ static long read_conn(struct mg_connection *c) {
   return n;
 }
 
+#if MG_ENABLE_WRITEV
+// Write c->send interleaved with queued shared buffers, in queue order
+static void write_shared(struct mg_connection *c) {
+  struct mg_shared_ref *refs = (struct mg_shared_ref *) c->shared.buf;
+  size_t i, nrefs = c->shared.len / sizeof(*refs), niov = 0, pos = 0;
+  size_t left, from_send = 0, done = 0;
+  struct iovec iov[MG_MAX_IOV];
+  long n;
+
+  for (i = 0; i < nrefs && niov + 2 <= MG_MAX_IOV; i++) {
+    if (refs[i].mark > pos) {
+      iov[niov].iov_base = c->send.buf + pos;
+      iov[niov++].iov_len = refs[i].mark - pos;
+      pos = refs[i].mark;
+    }
+    iov[niov].iov_base = refs[i].s->buf + refs[i].ofs;
+    iov[niov++].iov_len = refs[i].s->len - refs[i].ofs;
+  }
+  if (i == nrefs && pos < c->send.len) {
+    iov[niov].iov_base = c->send.buf + pos;
+    iov[niov++].iov_len = c->send.len - pos;
+  }
+
+  n = writev(FD(c), iov, (int) niov);
+  n = n == 0 ? -1 : n < 0 && mg_sock_would_block() ? 0 : n;
+  MG_DEBUG(("%lu %p %d:%d:%d %ld err %d (%s)", c->id, c->fd, (int) c->send.len,
+            (int) nrefs, (int) c->recv.len, n, MG_SOCK_ERRNO,
+            strerror(errno)));
+  if (n <= 0) {
+    iolog(c, NULL, n, false);
+    return;
+  }
+
+  // Walk the same order again to see what got out
+  left = (size_t) n, pos = 0;
+  for (i = 0; i < nrefs && left > 0; i++) {
+    size_t rem;
+    if (refs[i].mark > pos) {
+      size_t k = refs[i].mark - pos < left ? refs[i].mark - pos : left;
+      pos += k, from_send += k, left -= k;
+      if (left == 0) break;
+    }
+    rem = refs[i].s->len - refs[i].ofs;
+    if (left < rem) {
+      refs[i].ofs += left;
+      left = 0;
+    } else {
+      left -= rem;
+      done++;
+    }
+  }
+  from_send += left;  // Whatever remains came from the tail of c->send
+
+  c->shared_pending -= (size_t) n - from_send;
+  mg_shared_release(c, done * sizeof(*refs));
+  refs = (struct mg_shared_ref *) c->shared.buf;
+  for (i = 0; i < nrefs - done; i++) refs[i].mark -= from_send;
+  mg_iobuf_del(&c->send, 0, from_send);
+  mg_call(c, MG_EV_WRITE, &n);
+}
+#endif
+
 static void write_conn(struct mg_connection *c) {
   char *buf = (char *) c->send.buf;
   size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_sock_send(c, buf, len);
+  long n;
+#if MG_ENABLE_WRITEV
+  if (c->shared.len > 0) {
+    write_shared(c);
+    return;
+  }
+#endif
+  n = c->is_tls ? mg_tls_send(c, buf, len) : mg_sock_send(c, buf, len);
   MG_DEBUG(("%lu %p %d:%d %ld err %d (%s)", c->id, c->fd, (int) c->send.len,
             (int) c->recv.len, n, MG_SOCK_ERRNO, strerror(errno)));
   iolog(c, buf, n, false);
@@ -4216,6 +4455,9 @@ static void write_conn(struct mg_connection *c) {
 
 static void close_conn(struct mg_connection *c) {
   if (FD(c) != INVALID_SOCKET) {
+#if MG_ENABLE_EPOLL
+    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+#endif
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS_TCP
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
@@ -4269,6 +4511,9 @@ void mg_connect_resolved(struct mg_connection *c) {
       mg_error(c, "connect: %d", MG_SOCK_ERRNO);
     }
   }
+#if MG_ENABLE_EPOLL
+  if (FD(c) != INVALID_SOCKET) mg_epoll_add(c);
+#endif
 }
 
 static SOCKET raccept(SOCKET sock, union usa *usa, socklen_t len) {
@@ -4318,6 +4563,9 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     c->pfn_data = lsn->pfn_data;
     c->fn = lsn->fn;
     c->fn_data = lsn->fn_data;
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
     mg_call(c, MG_EV_OPEN, NULL);
     mg_call(c, MG_EV_ACCEPT, NULL);
   }
@@ -4375,7 +4623,7 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
   for (c = mgr->conns; c != NULL; c = c->next) {
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
     FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_READ | eSELECT_EXCEPT);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
+    if (c->is_connecting || (MG_SEND_PENDING(c) && c->is_tls_hs == 0))
       FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
   }
   FreeRTOS_select(mgr->ss, pdMS_TO_TICKS(ms));
@@ -4386,6 +4634,22 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     FreeRTOS_FD_CLR(c->fd, mgr->ss,
                     eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
+#elif MG_ENABLE_EPOLL
+  // Only ready connections are touched here. They go on the ready list,
+  // and their flags are cleared again by mg_mgr_poll() once serviced.
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  int i, n;
+  if (mgr->ready != NULL) ms = 0;  // Don't sleep on ones already ready
+  n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms);
+  for (i = 0; i < n; i++) {
+    struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
+    mg_epoll_ready(c);
+    if (c->is_closing || c->is_resolving) continue;
+    // Report errors and hangups as readable, so read_conn() picks them up
+    c->is_readable =
+        evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) ? 1 : 0;
+    c->is_writable = evs[i].events & EPOLLOUT ? 1 : 0;
+  }
 #elif MG_ENABLE_POLL
   size_t i = 0, n = 0;
   for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) n++;
@@ -4398,7 +4662,7 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     } else {
       fds[i].fd = FD(c);
       fds[i].events |= POLLIN;
-      if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0)) {
+      if (c->is_connecting || (MG_SEND_PENDING(c) && c->is_tls_hs == 0)) {
         fds[i].events |= POLLOUT;
       }
       if (mg_tls_pending(c) > 0) ms = 0;  // Don't wait if TLS is ready
@@ -4407,17 +4671,20 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
 
   if (poll(fds, n, ms) < 0) {
     //MG_ERROR(("poll failed, errno: %d", MG_SOCK_ERRNO));
-  } else {
-    i = 0;
-    for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next, i++) {
-      if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) {
-        // Socket not valid, ignore
-      } else {
-        c->is_readable = (unsigned) (fds[i].revents & POLLIN ? true : false);
-        c->is_writable = (unsigned) (fds[i].revents & POLLOUT ? true : false);
-        fds[i].revents = 0;
-        if (mg_tls_pending(c) > 0) c->is_readable = 1;
-      }
+    // Interrupted by a signal, say. Nothing is ready then, and the flags of
+    // the last poll must not stay: a stale is_writable with nothing left to
+    // send makes write_conn() get 0 back, which closes the connection.
+    memset(fds, 0, sizeof(fds));
+  }
+  i = 0;
+  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next, i++) {
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) {
+      // Socket not valid, ignore
+    } else {
+      c->is_readable = (unsigned) (fds[i].revents & POLLIN ? true : false);
+      c->is_writable = (unsigned) (fds[i].revents & POLLOUT ? true : false);
+      fds[i].revents = 0;
+      if (mg_tls_pending(c) > 0) c->is_readable = 1;
     }
   }
 #else
@@ -4434,7 +4701,7 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
     FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
+    if (c->is_connecting || (MG_SEND_PENDING(c) && c->is_tls_hs == 0))
       FD_SET(FD(c), &wset);
     if (mg_tls_pending(c) > 0) tv = tv_zero;
   }
@@ -4475,6 +4742,28 @@ static void connect_conn(struct mg_connection *c) {
   }
 }
 
+// Reads, writes, accepts or finishes connecting, whatever c is ready for
+static void mg_service_conn(struct mg_mgr *mgr, struct mg_connection *c) {
+  MG_VERBOSE(("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
+              c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
+              c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
+              c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
+  if (c->is_resolving || c->is_closing) {
+    // Do nothing
+  } else if (c->is_listening && c->is_udp == 0) {
+    if (c->is_readable) accept_conn(mgr, c);
+  } else if (c->is_connecting) {
+    if (c->is_readable || c->is_writable) connect_conn(c);
+  } else if (c->is_tls_hs) {
+    if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+  } else {
+    if (c->is_readable) read_conn(c);
+    if (c->is_writable) write_conn(c);
+  }
+
+  if (c->is_draining && !MG_SEND_PENDING(c)) c->is_closing = 1;
+}
+
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   uint64_t now;
@@ -4483,29 +4772,27 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   now = mg_millis();
   mg_timer_poll(&mgr->timers, now);
 
+#if MG_ENABLE_EPOLL
+  // MG_EV_POLL comes from mg_epoll_poll_fn() instead. Whatever gets ready
+  // while these are serviced waits for the next poll.
+  c = mgr->ready;
+  mgr->ready = NULL;
+  for (; c != NULL; c = tmp) {
+    tmp = c->ready_next;
+    mg_service_conn(mgr, c);
+    c->is_ready = 0;
+    c->is_readable = c->is_writable = 0;
+    if (!c->is_closing) mg_epoll_sync(c);
+    if (c->is_closing) close_conn(c);
+  }
+#else
   for (c = mgr->conns; c != NULL; c = tmp) {
     tmp = c->next;
     mg_call(c, MG_EV_POLL, &now);
-    MG_VERBOSE(("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
-                c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
-                c->is_connecting ? 'C' : 'c', c->is_tls_hs ? 'H' : 'h',
-                c->is_resolving ? 'R' : 'r', c->is_closing ? 'C' : 'c'));
-    if (c->is_resolving || c->is_closing) {
-      // Do nothing
-    } else if (c->is_listening && c->is_udp == 0) {
-      if (c->is_readable) accept_conn(mgr, c);
-    } else if (c->is_connecting) {
-      if (c->is_readable || c->is_writable) connect_conn(c);
-    } else if (c->is_tls_hs) {
-      if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
-    } else {
-      if (c->is_readable) read_conn(c);
-      if (c->is_writable) write_conn(c);
-    }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+    mg_service_conn(mgr, c);
     if (c->is_closing) close_conn(c);
   }
+#endif
 }
 #endif
 
@@ -5657,9 +5944,205 @@ struct ws_msg {
   size_t data_len;
 };
 
+#define MG_WS_RSV1 0x40  // Set on compressed messages, RFC 7692 section 6
+
+#if MG_ENABLE_WS_DEFLATE
+struct mg_ws_deflate {
+  z_stream tx, rx;
+  bool tx_ready, rx_ready;  // Streams are initialised on first use
+  bool takeover;            // Keep tx context between messages
+  int tx_bits, rx_bits;     // Negotiated LZ77 window sizes
+  struct mg_iobuf scratch;  // Compressed outgoing message
+};
+
+static const uint8_t s_deflate_tail[4] = {0, 0, 0xff, 0xff};
+
+// Take the next sep-delimited token off s, whitespace stripped
+static bool ws_next_token(struct mg_str *s, char sep, struct mg_str *tok) {
+  const char *p;
+  size_t n;
+  if (s->len == 0) return false;
+  p = (const char *) memchr(s->ptr, sep, s->len);
+  n = p == NULL ? s->len : (size_t) (p - s->ptr);
+  *tok = mg_strstrip(mg_str_n(s->ptr, n));
+  if (n < s->len) n++;  // Skip the separator
+  s->ptr += n, s->len -= n;
+  return true;
+}
+
+// Parse a *_max_window_bits value, -1 if it isn't a valid one
+static int ws_window_bits(struct mg_str v) {
+  int bits = 0;
+  size_t i;
+  if (v.len >= 2 && v.ptr[0] == '"' && v.ptr[v.len - 1] == '"') {
+    v.ptr++, v.len -= 2;
+  }
+  if (v.len == 0 || v.len > 2) return -1;
+  for (i = 0; i < v.len; i++) {
+    if (v.ptr[i] < '0' || v.ptr[i] > '9') return -1;
+    bits = bits * 10 + v.ptr[i] - '0';
+  }
+  return bits >= 8 && bits <= 15 ? bits : -1;
+}
+
+// Accept the first permessage-deflate offer we can honour, RFC 7692 section 7.
+// Writes the Sec-WebSocket-Extensions response value into buf.
+static void ws_negotiate_deflate(struct mg_connection *c, struct mg_str offers,
+                                 char *buf, size_t len) {
+  struct mg_str offer, name, param;
+  while (ws_next_token(&offers, ',', &offer)) {
+    bool ok = true, no_takeover = !c->mgr->ws_deflate_takeover;
+    bool server_bits = false;
+    int tx_bits = MG_WS_DEFLATE_WINDOW_BITS, rx_bits = 15, client_bits = 0;
+    struct mg_ws_deflate *d;
+    ws_next_token(&offer, ';', &name);
+    if (mg_vcasecmp(&name, "permessage-deflate") != 0) continue;
+    while (ok && ws_next_token(&offer, ';', &param)) {
+      const char *eq = (const char *) memchr(param.ptr, '=', param.len);
+      struct mg_str k = param, v = mg_str_n("", 0);
+      if (eq != NULL) {
+        k = mg_strstrip(mg_str_n(param.ptr, (size_t) (eq - param.ptr)));
+        v = mg_strstrip(
+            mg_str_n(eq + 1, (size_t) (param.ptr + param.len - eq - 1)));
+      }
+      if (mg_vcasecmp(&k, "server_no_context_takeover") == 0) {
+        no_takeover = true;
+      } else if (mg_vcasecmp(&k, "client_no_context_takeover") == 0) {
+        // Our inflater copes either way
+      } else if (mg_vcasecmp(&k, "server_max_window_bits") == 0) {
+        int bits = ws_window_bits(v);
+        // zlib can't do raw deflate with an 8 bit window
+        if (bits < 9) ok = false;
+        if (bits < tx_bits) tx_bits = bits;
+        server_bits = true;
+      } else if (mg_vcasecmp(&k, "client_max_window_bits") == 0) {
+        int bits = v.len == 0 ? 15 : ws_window_bits(v);
+        if (bits < 0) ok = false;
+        // Ask the client for a small window, that's what we inflate with
+        client_bits = rx_bits =
+            bits < MG_WS_DEFLATE_WINDOW_BITS ? bits : MG_WS_DEFLATE_WINDOW_BITS;
+      } else {
+        ok = false;  // Unknown parameter, decline this offer
+      }
+    }
+    if (!ok) continue;
+    if ((d = (struct mg_ws_deflate *) calloc(1, sizeof(*d))) == NULL) return;
+    d->takeover = !no_takeover;
+    d->tx_bits = tx_bits;
+    d->rx_bits = rx_bits;
+    c->ws_deflate = d;
+    mg_snprintf(buf, len, "permessage-deflate%s", no_takeover ? "; server_no_context_takeover" : "");
+    if (server_bits) {
+      size_t n = strlen(buf);
+      mg_snprintf(buf + n, len - n, "; server_max_window_bits=%d", tx_bits);
+    }
+    if (client_bits) {
+      size_t n = strlen(buf);
+      mg_snprintf(buf + n, len - n, "; client_max_window_bits=%d", client_bits);
+    }
+    return;
+  }
+}
+
+// Compress one message with Z_SYNC_FLUSH and drop the trailing empty block,
+// RFC 7692 section 7.2.1. Result is appended to out.
+static bool ws_deflate_msg(z_stream *zs, const char *buf, size_t len,
+                           struct mg_iobuf *out) {
+  zs->next_in = (Bytef *) buf;
+  zs->avail_in = (uInt) len;
+  do {
+    if (out->size - out->len < 64 &&
+        !mg_iobuf_resize(out, out->size + len / 2 + 64)) {
+      return false;
+    }
+    zs->next_out = out->buf + out->len;
+    zs->avail_out = (uInt) (out->size - out->len);
+    if (deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) return false;
+    out->len = out->size - zs->avail_out;
+  } while (zs->avail_out == 0);
+  if (out->len >= 4 && memcmp(out->buf + out->len - 4, s_deflate_tail, 4) == 0)
+    out->len -= 4;
+  return true;
+}
+
+static bool ws_deflate_init(z_stream *zs, int bits) {
+  memset(zs, 0, sizeof(*zs));
+  return deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -bits,
+                      MG_WS_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+// Decompress one message, appending the empty block that the sender stripped
+static bool ws_inflate_msg(struct mg_ws_deflate *d, const char *buf,
+                           size_t len, struct mg_iobuf *out) {
+  const uint8_t *in[2] = {(const uint8_t *) buf, s_deflate_tail};
+  size_t in_len[2] = {len, sizeof(s_deflate_tail)}, i;
+  if (!d->rx_ready) {
+    memset(&d->rx, 0, sizeof(d->rx));
+    if (inflateInit2(&d->rx, -d->rx_bits) != Z_OK) return false;
+    d->rx_ready = true;
+  }
+  for (i = 0; i < 2; i++) {
+    d->rx.next_in = (Bytef *) in[i];
+    d->rx.avail_in = (uInt) in_len[i];
+    while (d->rx.avail_in > 0) {
+      int ret;
+      if (out->size - out->len < 256 &&
+          (out->size >= MG_MAX_RECV_BUF_SIZE ||
+           !mg_iobuf_resize(out, out->size * 2 + 256))) {
+        return false;  // Too big, or OOM
+      }
+      d->rx.next_out = out->buf + out->len;
+      d->rx.avail_out = (uInt) (out->size - out->len);
+      ret = inflate(&d->rx, Z_SYNC_FLUSH);
+      out->len = out->size - d->rx.avail_out;
+      if (ret == Z_STREAM_END) {
+        // Sender finished the stream, next message starts a fresh one
+        inflateReset(&d->rx);
+        return true;
+      }
+      if (ret != Z_OK && ret != Z_BUF_ERROR) return false;
+    }
+  }
+  return true;
+}
+
+static bool ws_should_deflate(struct mg_connection *c, size_t len, int op) {
+  return c->ws_deflate != NULL && !(op & WEBSOCKET_NO_DEFLATE) &&
+         ((op & 15) == WEBSOCKET_OP_TEXT || (op & 15) == WEBSOCKET_OP_BINARY) &&
+         len >= MG_WS_DEFLATE_MIN_LEN;
+}
+#endif
+
+int mg_ws_deflate_mode(const struct mg_connection *c) {
+#if MG_ENABLE_WS_DEFLATE
+  const struct mg_ws_deflate *d = c->ws_deflate;
+  if (d == NULL) return MG_WS_DEFLATE_OFF;
+  // Shared frames are compressed statelessly with the default window
+  if (!d->takeover && d->tx_bits >= MG_WS_DEFLATE_WINDOW_BITS) {
+    return MG_WS_DEFLATE_SHARED;
+  }
+  return MG_WS_DEFLATE_OWN;
+#else
+  (void) c;
+  return MG_WS_DEFLATE_OFF;
+#endif
+}
+
+void mg_ws_deflate_free(struct mg_connection *c) {
+#if MG_ENABLE_WS_DEFLATE
+  struct mg_ws_deflate *d = c->ws_deflate;
+  if (d == NULL) return;
+  if (d->tx_ready) deflateEnd(&d->tx);
+  if (d->rx_ready) inflateEnd(&d->rx);
+  mg_iobuf_free(&d->scratch);
+  free(d);
+#endif
+  c->ws_deflate = NULL;
+}
+
 static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
-                         const struct mg_str *wsproto, const char *fmt,
-                         va_list ap) {
+                         const struct mg_str *wsproto, const char *wsext,
+                         const char *fmt, va_list ap) {
   const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   unsigned char sha[20], b64_sha[30];
   char mem[128], *buf = mem;
@@ -5684,6 +6167,9 @@ static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
     mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) wsproto->len,
               wsproto->ptr);
   }
+  if (wsext[0] != '\0') {
+    mg_printf(c, "Sec-WebSocket-Extensions: %s\r\n", wsext);
+  }
   mg_send(c, "\r\n", 2);
 }
 
@@ -5720,7 +6206,7 @@ static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
 
 static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
   size_t n = 0;
-  buf[0] = (uint8_t) (op | 128);
+  buf[0] = (uint8_t) ((op & 15) | 128);
   if (len < 126) {
     buf[1] = (unsigned char) len;
     n = 2;
@@ -5757,7 +6243,36 @@ static void mg_ws_mask(struct mg_connection *c, size_t len) {
 size_t mg_ws_send(struct mg_connection *c, const char *buf, size_t len,
                   int op) {
   uint8_t header[14];
-  size_t header_len = mkhdr(len, op, c->is_client, header);
+  size_t header_len;
+#if MG_ENABLE_WS_DEFLATE
+  if (ws_should_deflate(c, len, op)) {
+    struct mg_ws_deflate *d = c->ws_deflate;
+    struct mg_iobuf *z = &d->scratch;
+    z->len = 0;
+    if (!d->tx_ready && !(d->tx_ready = ws_deflate_init(&d->tx, d->tx_bits))) {
+      mg_error(c, "WS deflate init");
+      return 0;
+    }
+    if (!ws_deflate_msg(&d->tx, buf, len, z)) {
+      mg_error(c, "WS deflate");
+      return 0;
+    }
+    if (!d->takeover) deflateReset(&d->tx);
+    // Without context takeover nothing depends on this message being sent
+    // compressed, so keep it plain when deflate didn't help
+    if (d->takeover || z->len < len) {
+      header_len = mkhdr(z->len, op, c->is_client, header);
+      header[0] |= MG_WS_RSV1;
+      mg_send(c, header, header_len);
+      mg_send(c, z->buf, z->len);
+      mg_ws_mask(c, z->len);
+      len = z->len;
+      if (z->size > MG_IO_SIZE * 16) mg_iobuf_free(z);
+      return header_len + len;
+    }
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
   mg_send(c, header, header_len);
   MG_VERBOSE(("WS out: %d [%.*s]", (int) len, (int) len, buf));
   mg_send(c, buf, len);
@@ -5765,6 +6280,27 @@ size_t mg_ws_send(struct mg_connection *c, const char *buf, size_t len,
   return header_len + len;
 }
 
+// Hand a complete message to the user, inflating it first if compressed
+static void ws_deliver(struct mg_connection *c, struct mg_ws_message *m) {
+#if MG_ENABLE_WS_DEFLATE
+  if (m->flags & MG_WS_RSV1) {
+    struct mg_iobuf out = {NULL, 0, 0};
+    if (c->ws_deflate == NULL) {
+      mg_error(c, "WS compressed message without permessage-deflate");
+    } else if (!ws_inflate_msg(c->ws_deflate, m->data.ptr, m->data.len, &out)) {
+      mg_error(c, "WS inflate");
+    } else {
+      m->data = mg_str_n((char *) out.buf, out.len);
+      m->flags &= (uint8_t) ~MG_WS_RSV1;
+      mg_call(c, MG_EV_WS_MSG, m);
+    }
+    mg_iobuf_free(&out);
+    return;
+  }
+#endif
+  mg_call(c, MG_EV_WS_MSG, m);
+}
+
 static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
                      void *fn_data) {
   struct ws_msg msg;
@@ -5813,7 +6349,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
           break;
         case WEBSOCKET_OP_TEXT:
         case WEBSOCKET_OP_BINARY:
-          if (final) mg_call(c, MG_EV_WS_MSG, &m);
+          if (final) ws_deliver(c, &m);
           break;
         case WEBSOCKET_OP_CLOSE:
           MG_DEBUG(("%lu Got WS CLOSE", c->id));
@@ -5842,7 +6378,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
       if (final && !op) {
         m.flags = c->recv.buf[0];
         m.data = mg_str_n((char *) &c->recv.buf[1], (size_t) (ofs - 1));
-        mg_call(c, MG_EV_WS_MSG, &m);
+        ws_deliver(c, &m);
         mg_iobuf_del(&c->recv, 0, ofs);
         ofs = 0;
         c->pfn_data = NULL;
@@ -5901,15 +6437,84 @@ void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
     c->is_draining = 1;
   } else {
     struct mg_str *wsproto = mg_http_get_header(hm, "Sec-WebSocket-Protocol");
+    char wsext[128] = "";
     va_list ap;
+#if MG_ENABLE_WS_DEFLATE
+    struct mg_str *offers = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+    if (c->mgr->ws_deflate && offers != NULL) {
+      ws_negotiate_deflate(c, *offers, wsext, sizeof(wsext));
+    }
+#endif
     va_start(ap, fmt);
-    ws_handshake(c, wskey, wsproto, fmt, ap);
+    ws_handshake(c, wskey, wsproto, wsext, fmt, ap);
     va_end(ap);
     c->is_websocket = 1;
     mg_call(c, MG_EV_WS_OPEN, hm);
   }
 }
 
+// Frame a server-to-client message once, for sending with mg_send_shared()
+struct mg_shared *mg_ws_shared(const char *buf, size_t len, int op) {
+  uint8_t header[14];
+  size_t header_len = mkhdr(len, op, false, header);
+  struct mg_shared *s = mg_shared_new(NULL, header_len + len);
+  if (s != NULL) {
+    memcpy(s->buf, header, header_len);
+    if (len > 0) memcpy(s->buf + header_len, buf, len);
+  }
+  return s;
+}
+
+// count messages of len bytes each from buf, framed back to back, so they go out with one mg_send_shared()
+struct mg_shared *mg_ws_shared_many(const char *buf, size_t count, size_t len,
+                                    int op) {
+  uint8_t header[14];
+  size_t header_len = mkhdr(len, op, false, header), i;
+  struct mg_shared *s = mg_shared_new(NULL, count * (header_len + len));
+  if (s != NULL) {
+    for (i = 0; i < count; i++) {
+      uint8_t *p = s->buf + i * (header_len + len);
+      memcpy(p, header, header_len);
+      if (len > 0) memcpy(p + header_len, buf + i * len, len);
+    }
+  }
+  return s;
+}
+
+// Same as mg_ws_shared(), but compressed for MG_WS_DEFLATE_SHARED connections.
+// Returns NULL when the message is better sent plain.
+struct mg_shared *mg_ws_shared_deflate(const char *buf, size_t len, int op) {
+  struct mg_shared *s = NULL;
+#if MG_ENABLE_WS_DEFLATE
+  struct mg_iobuf z = {NULL, 0, 0};
+  z_stream zs;
+  if (!(op & WEBSOCKET_NO_DEFLATE) && len >= MG_WS_DEFLATE_MIN_LEN &&
+      ws_deflate_init(&zs, MG_WS_DEFLATE_WINDOW_BITS)) {
+    if (ws_deflate_msg(&zs, buf, len, &z) && z.len < len) {
+      uint8_t header[14];
+      size_t header_len = mkhdr(z.len, op, false, header);
+      header[0] |= MG_WS_RSV1;
+      if ((s = mg_shared_new(NULL, header_len + z.len)) != NULL) {
+        memcpy(s->buf, header, header_len);
+        memcpy(s->buf + header_len, z.buf, z.len);
+      }
+    }
+    deflateEnd(&zs);
+    mg_iobuf_free(&z);
+  }
+#else
+  (void) buf, (void) len, (void) op;
+#endif
+  return s;
+}
+
+// Payload of a frame made by mg_ws_shared()
+struct mg_str mg_ws_shared_data(const struct mg_shared *s) {
+  size_t n = s->buf[1] & 127;
+  size_t header_len = n < 126 ? 2 : n == 126 ? 4 : 10;
+  return mg_str_n((const char *) s->buf + header_len, s->len - header_len);
+}
+
 size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   uint8_t header[14], *p;
   size_t header_len = mkhdr(len, op, c->is_client, header);
@@ -440,6 +440,12 @@ extern int SockSet(SOCKET hSock, int Type, int Prop, void *pbuf, int size);
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+#if defined(MG_ENABLE_WS_DEFLATE) && MG_ENABLE_WS_DEFLATE
+#include <zlib.h>
+#endif
 #if defined(MG_ENABLE_POLL) && MG_ENABLE_POLL
 #include <poll.h>
 #else
@@ -449,6 +455,7 @@ extern int SockSet(SOCKET hSock, int Type, int Prop, void *pbuf, int size);
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -456,6 +463,10 @@ extern int SockSet(SOCKET hSock, int Type, int Prop, void *pbuf, int size);
 #define MG_ENABLE_DIRLIST 1
 #endif
 
+#ifndef MG_ENABLE_WRITEV
+#define MG_ENABLE_WRITEV 1
+#endif
+
 #endif
 
 
@@ -590,6 +601,42 @@ int sscanf(const char *, const char *, ...);
 #define MG_ENABLE_POLL 0
 #endif
 
+#ifndef MG_ENABLE_EPOLL
+#define MG_ENABLE_EPOLL 0
+#endif
+
+#ifndef MG_ENABLE_WRITEV
+#define MG_ENABLE_WRITEV 0
+#endif
+
+#ifndef MG_MAX_IOV
+#define MG_MAX_IOV 64  // Max buffers handed to one writev()
+#endif
+
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 512  // Max events returned by one epoll_wait()
+#endif
+
+#ifndef MG_EPOLL_POLL_MS
+#define MG_EPOLL_POLL_MS 1000  // How often every connection gets MG_EV_POLL
+#endif
+
+#ifndef MG_ENABLE_WS_DEFLATE
+#define MG_ENABLE_WS_DEFLATE 0  // RFC 7692 permessage-deflate, needs zlib
+#endif
+
+#ifndef MG_WS_DEFLATE_WINDOW_BITS
+#define MG_WS_DEFLATE_WINDOW_BITS 11  // LZ77 window we compress with, 9..15
+#endif
+
+#ifndef MG_WS_DEFLATE_MEM_LEVEL
+#define MG_WS_DEFLATE_MEM_LEVEL 4  // zlib memLevel, 1..9
+#endif
+
+#ifndef MG_WS_DEFLATE_MIN_LEN
+#define MG_WS_DEFLATE_MIN_LEN 16  // Shorter messages are sent uncompressed
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -876,6 +923,18 @@ void mg_iobuf_free(struct mg_iobuf *);
 size_t mg_iobuf_add(struct mg_iobuf *, size_t, const void *, size_t, size_t);
 size_t mg_iobuf_del(struct mg_iobuf *, size_t ofs, size_t len);
 
+// Immutable, reference-counted buffer. It can be queued on any number of
+// connections with mg_send_shared() without being copied.
+struct mg_shared {
+  size_t refs;          // Reference count, updated atomically
+  size_t len;           // Length of data
+  unsigned char buf[];  // Data
+};
+
+struct mg_shared *mg_shared_new(const void *buf, size_t len);
+void mg_shared_ref(struct mg_shared *);
+void mg_shared_unref(struct mg_shared *);
+
 int mg_base64_update(unsigned char p, char *to, int len);
 int mg_base64_final(char *to, int len);
 int mg_base64_encode(const unsigned char *p, int n, char *to);
@@ -971,6 +1030,13 @@ struct mg_mgr {
 #if MG_ARCH == MG_ARCH_FREERTOS_TCP
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
+#if MG_ENABLE_EPOLL
+  int epoll_fd;  // epoll instance all sockets are registered with
+  struct mg_connection *ready;  // To service on the next poll
+#endif
+  bool ws_deflate;           // Accept permessage-deflate offers
+  bool ws_deflate_takeover;  // Keep compression context between messages
+  bool reuseport;            // Set SO_REUSEPORT on listeners made from here on
 };
 
 struct mg_connection {
@@ -982,6 +1048,8 @@ struct mg_connection {
   unsigned long id;            // Auto-incrementing unique connection ID
   struct mg_iobuf recv;        // Incoming data
   struct mg_iobuf send;        // Outgoing data
+  struct mg_iobuf shared;      // Queued shared buffers, see mg_send_shared()
+  size_t shared_pending;       // Unsent bytes in shared buffers
   mg_event_handler_t fn;       // User-specified event handler function
   void *fn_data;               // User-specified function parameter
   mg_event_handler_t pfn;      // Protocol-specific handler function
@@ -1002,6 +1070,12 @@ struct mg_connection {
   unsigned is_closing : 1;     // Close and free the connection immediately
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+#if MG_ENABLE_EPOLL
+  unsigned is_epollout : 1;    // EPOLLOUT interest is registered
+  unsigned is_ready : 1;       // In mgr->ready
+  struct mg_connection *ready_next;  // Linkage in struct mg_mgr :: ready
+#endif
+  struct mg_ws_deflate *ws_deflate;  // Negotiated permessage-deflate state
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
@@ -1016,6 +1090,8 @@ struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
                                 mg_event_handler_t fn, void *fn_data);
 void mg_connect_resolved(struct mg_connection *);
 bool mg_send(struct mg_connection *, const void *, size_t);
+bool mg_send_shared(struct mg_connection *, struct mg_shared *);
+size_t mg_send_backlog(const struct mg_connection *);
 size_t mg_printf(struct mg_connection *, const char *fmt, ...);
 size_t mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 char *mg_straddr(struct mg_addr *, char *, size_t);
@@ -1161,6 +1237,14 @@ struct mg_tls {
 #define WEBSOCKET_OP_CLOSE 8
 #define WEBSOCKET_OP_PING 9
 #define WEBSOCKET_OP_PONG 10
+#define WEBSOCKET_NO_DEFLATE 0x100  // OR into op to skip compression
+
+// How a connection wants its messages compressed, see mg_ws_deflate_mode()
+enum {
+  MG_WS_DEFLATE_OFF,     // Not negotiated, send plain frames
+  MG_WS_DEFLATE_SHARED,  // Frames from mg_ws_shared_deflate() are fine
+  MG_WS_DEFLATE_OWN      // Own compression context, use mg_ws_send()
+};
 
 
 
@@ -1176,6 +1260,13 @@ void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
                    const char *fmt, ...);
 size_t mg_ws_send(struct mg_connection *, const char *buf, size_t len, int op);
 size_t mg_ws_wrap(struct mg_connection *, size_t len, int op);
+struct mg_shared *mg_ws_shared(const char *buf, size_t len, int op);
+struct mg_shared *mg_ws_shared_many(const char *buf, size_t count, size_t len,
+                                    int op);
+struct mg_shared *mg_ws_shared_deflate(const char *buf, size_t len, int op);
+struct mg_str mg_ws_shared_data(const struct mg_shared *);
+int mg_ws_deflate_mode(const struct mg_connection *);
+void mg_ws_deflate_free(struct mg_connection *);
 
 
 
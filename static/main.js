@@ -184,6 +184,8 @@ class Canvas {
 		this.size = 0;
 		this.client = client;
 		this.pixels = [];
+		this.fills_pending = 0;
+		this.queued = null; // Updates received while a canvas is decompressing
 
 		document.body.style.mozUserSelect = document.body.style.webkitUserSelect = document.body.style.userSelect = 'none';
 		// Mouse down event to start dragging
@@ -272,9 +274,73 @@ class Canvas {
 		this.ctx.fillStyle = this.color_list.get_color(c);
 		this.ctx.fillRect(x, y, 1, 1);
 	}
+
+	set_pixel(i, c) {
+		if (this.queued) {
+			this.queued.push([i, c]);
+			return;
+		}
+		const x = Math.round(i % this.size);
+		const y = Math.floor(i / this.size);
+		this.pixels[i] = c;
+		this.draw_pixel(x, y, c);
+	}
 	
 	fill(data) {
-		decompress(data).then(data => {
+		this.fill_with(decompress(data));
+	}
+
+	fill_chunks(buffer) {
+		this.fill_with(decode_chunks(buffer, 0).then(([size, chunks]) => {
+			const pixels = new Array(size * size);
+			for (const [x0, y0, width, colors] of chunks) {
+				for (let k = 0; k < colors.length; ++k) {
+					pixels[x0 + (k % width) + (y0 + Math.floor(k / width)) * size] = colors[k];
+				}
+			}
+			return pixels;
+		}));
+	}
+
+	// Part of the canvas, see RES_CANVAS_REGION on the server
+	fill_region(buffer) {
+		const level = new DataView(buffer).getUint8(1);
+		decode_chunks(buffer, 10).then(([size, chunks]) => {
+			if (level) {
+				this.draw_overview(1 << level, size, chunks);
+				return;
+			}
+			// Haven't loaded any of it yet, start from a blank one
+			if (this.size !== size && !this.fills_pending) this.fill_with(Promise.resolve(new Array(size * size).fill(0)));
+			for (const [x0, y0, width, colors] of chunks) {
+				for (let k = 0; k < colors.length; ++k) {
+					this.set_pixel(x0 + (k % width) + (y0 + Math.floor(k / width)) * size, colors[k]);
+				}
+			}
+		});
+	}
+
+	// A scaled down level, as a placeholder until we have the canvas itself
+	draw_overview(scale, size, chunks) {
+		if (this.pixels.length || this.fills_pending) return;
+		if (this.canvas.width !== size * scale) {
+			this.canvas.width = size * scale;
+			this.canvas.height = size * scale;
+		}
+		for (const [x0, y0, width, colors] of chunks) {
+			for (let k = 0; k < colors.length; ++k) {
+				this.ctx.fillStyle = this.color_list.get_color(colors[k]);
+				this.ctx.fillRect((x0 + k % width) * scale, (y0 + Math.floor(k / width)) * scale, scale, scale);
+			}
+		}
+	}
+
+	fill_with(pixels) {
+		// The server may send a fresh canvas at any time, if we fell behind.
+		// Updates after it must land on top of it, not get overwritten.
+		this.queued = this.queued || [];
+		this.fills_pending++;
+		pixels.then(data => {
 			this.size = Math.sqrt(data.length);
 			this.canvas.width = this.size;
 			this.canvas.height = this.size;
@@ -287,6 +353,12 @@ class Canvas {
 					this.draw_pixel(x, y, data[counter++]);
 				}
 			}
+			if (--this.fills_pending > 0) return;
+			const queued = this.queued;
+			this.queued = null;
+			for (const [i, c] of queued) {
+				this.set_pixel(i, c);
+			}
 		});
 	}
 }
@@ -299,6 +371,11 @@ const req = {
 	POST_TILE: 4,
 	GET_COLORS: 5,
 	SET_USERNAME: 6,
+	GET_UPDATES: 7,
+	GET_REGION: 8,
+	SUBSCRIBE: 9,
+	// Flag for the compact form used after auth, the server knows who we are by then
+	SESSION: 0x80,
 };
 
 const bin = {
@@ -311,9 +388,78 @@ const bin = {
 	RES_TILE_INCREMENT: 6,
 	RES_LEVEL_UP: 7,
 	RES_USER_COUNT: 8,
+	RES_TILE_UPDATES: 9,
+	RES_CANVAS_CHUNKS: 10,
+	RES_CANVAS_PACKED: 11,
+	RES_CANVAS_REGION: 12,
 	ERR_INVALID_UUID: 128,
 };
 
+// Canvas codecs we can decode, best first. Ids as sent by the server.
+const canvas_codecs = ['zlib', 'zlib-packed', 'none'];
+const codec = {
+	// Not compressed, everything else we ask for is zlib
+	RAW: [0, 7],
+};
+
+// Chunks of the canvas compressed separately, see RES_CANVAS_CHUNKS and RES_CANVAS_PACKED on the server.
+// offs is where that starts, a RES_CANVAS_REGION has the level and rectangle of chunks in it before.
+// Resolves to the edge length of the level and [x0, y0, width, colors] for each chunk.
+function decode_chunks(buffer, offs) {
+	const view = new DataView(buffer);
+	let rect = null;
+	if (offs) rect = [2, 4, 6, 8].map(o => view.getUint16(o));
+	const packed = view.getUint8(offs) === bin.RES_CANVAS_PACKED;
+	const chunk_codec = view.getUint8(offs + 1);
+	const size = view.getUint16(offs + 2);
+	const chunk_edge = view.getUint16(offs + 4);
+	const per_edge = Math.ceil(size / chunk_edge);
+	const [cx, cy, cw, ch] = rect || [0, 0, per_edge, per_edge];
+	offs += 6;
+	let bits = 8;
+	let palette = null;
+	if (packed) {
+		bits = view.getUint8(offs);
+		const palette_len = view.getUint16(offs + 1);
+		palette = new Uint8Array(buffer, offs + 3, palette_len);
+		offs += 3 + palette_len;
+	}
+	const blobs = [];
+	for (let n = 0; n < cw * ch; ++n) {
+		const len = view.getUint32(offs);
+		blobs.push(new Uint8Array(buffer, offs + 4, len));
+		offs += 4 + len;
+	}
+	// Everything else we asked for is zlib
+	const decode = codec.RAW.includes(chunk_codec) ? blob => Promise.resolve(Array.from(blob)) : decompress;
+	return Promise.all(blobs.map(decode)).then(chunks => [size, chunks.map((chunk, n) => {
+		const x0 = (cx + n % cw) * chunk_edge;
+		const y0 = (cy + Math.floor(n / cw)) * chunk_edge;
+		const width = Math.min(chunk_edge, size - x0);
+		const height = Math.min(chunk_edge, size - y0);
+		if (packed) chunk = unpack_colors(chunk, width * height, bits, palette);
+		return [x0, y0, width, chunk];
+	})]);
+}
+
+// Bit-packed palette indices back to color ids, see RES_CANVAS_PACKED on the server
+function unpack_colors(bytes, count, bits, palette) {
+	const colors = new Array(count);
+	const mask = (1 << bits) - 1;
+	let acc = 0;
+	let pending = 0;
+	let offs = 0;
+	for (let k = 0; k < count; ++k) {
+		while (pending < bits) {
+			acc = ((acc << 8) | bytes[offs++]) & 0xffff;
+			pending += 8;
+		}
+		pending -= bits;
+		colors[k] = palette[(acc >> pending) & mask];
+	}
+	return colors;
+}
+
 class PixelClient {
 	connect() {
 		try {
@@ -338,6 +484,7 @@ class PixelClient {
 			max_tiles: 0,
 			user_count: 0, // TODO: Update UI for these somehow
 			disconnected: false,
+			last_seq: null, // Of the last tile update we got, to catch up from after a reconnect
 			url: url,
 			admin_perms: {
 				ban: false,
@@ -351,9 +498,9 @@ class PixelClient {
 	}
 	on_open() {
 		if (this.state.user_id !== null) {
-			this.ws.send(JSON.stringify({ "requestType": "auth", "userID": this.state.user_id.toString() }));
+			this.ws.send(JSON.stringify({ "requestType": "auth", "userID": this.state.user_id.toString(), "codecs": canvas_codecs }));
 		} else {
-			this.ws.send(JSON.stringify({ "requestType": "initialAuth" }));
+			this.ws.send(JSON.stringify({ "requestType": "initialAuth", "codecs": canvas_codecs }));
 		}
 	}
 	on_close() {
@@ -372,6 +519,29 @@ class PixelClient {
 		}
 	}
 
+	// After a reconnect, only ask for the tile updates we missed.
+	// The server sends the whole canvas instead if it doesn't have them all anymore.
+	request_canvas() {
+		if (this.state.last_seq !== null && this.state.canvas.pixels.length) {
+			this.ws.send(struct('BxI').pack(req.GET_UPDATES | req.SESSION, this.state.last_seq));
+		} else {
+			this.ws.send(struct('B').pack(req.GET_CANVAS | req.SESSION));
+		}
+	}
+
+	// Just the tiles in this rectangle, rounded out to whole chunks.
+	// For clients that only load what's on screen, this one shows the whole canvas.
+	// Zoomed out, level n gets it scaled down by 2^n, up to 3.
+	request_region(x, y, width, height, level = 0) {
+		this.ws.send(struct('BBHHHH').pack(req.GET_REGION | req.SESSION, level, x, y, width, height));
+	}
+
+	// Only get tile updates for this rectangle, rounded out to whole chunks, or all of them again
+	// with an empty one. Lasts until the connection does.
+	subscribe(x, y, width, height) {
+		this.ws.send(struct('BxHHHH').pack(req.SUBSCRIBE | req.SESSION, x, y, width, height));
+	}
+
 	on_binary_message(m) {
 		const data = new Uint8Array(m.data);
 		switch (data[0]) {
@@ -383,6 +553,15 @@ class PixelClient {
 				// actions.loadingScreenVisible(false);
 				// actions.setMessageBoxVisibility(false);
 				return;
+			case bin.RES_CANVAS_CHUNKS:
+			case bin.RES_CANVAS_PACKED:
+				// Has everything up to some update, it doesn't say which
+				this.state.last_seq = null;
+				this.state.canvas.fill_chunks(m.data);
+				return;
+			case bin.RES_CANVAS_REGION:
+				this.state.canvas.fill_region(m.data);
+				return;
 			case bin.RES_TILE_INFO:
 				console.log('RES_TILE_INFO');
 				return;
@@ -390,14 +569,22 @@ class PixelClient {
 			{
 				let s = struct('BBxxI');
 				let [_, c, i] = s.unpack(m.data);
-				const thing = {
-					c: c,
-					i: i,
-				};
-				const x = Math.round(i % this.state.canvas.size);
-				const y = Math.floor(i / this.state.canvas.size);
-				this.state.canvas.pixels[i] = c;
-				this.state.canvas.draw_pixel(x, y, c);
+				this.state.canvas.set_pixel(i, c);
+				return;
+			}
+			case bin.RES_TILE_UPDATES:
+			{
+				// Sequence number of the first one, then a batch of (index, color) pairs, 5 bytes each
+				const view = new DataView(m.data);
+				let seq = view.getUint32(1);
+				for (let offs = 5; offs + 5 <= m.data.byteLength; offs += 5, seq = (seq + 1) >>> 0) {
+					// Catching up after a reconnect, we may get some twice
+					if (this.state.last_seq !== null && ((seq - this.state.last_seq) | 0) <= 0) continue;
+					this.state.last_seq = seq;
+					const i = view.getUint32(offs);
+					const c = view.getUint8(offs + 4);
+					this.state.canvas.set_pixel(i, c);
+				}
 				return;
 			}
 			case bin.RES_COLOR_LIST:
@@ -412,7 +599,7 @@ class PixelClient {
 					colors[i] = { 'R': r, 'G': g, 'B': b, 'ID': id };
 				}
 				this.state.canvas.color_list = new ColorList(colors);
-				this.ws.send(struct('B37s').pack(req.GET_CANVAS, this.state.user_id));
+				this.request_canvas();
 				return;
 			}
 			case bin.RES_USERNAME_SET_SUCCESS:
@@ -422,7 +609,8 @@ class PixelClient {
 			{
 				let i = struct('BB');
 				let [_, c] = i.unpack(m.data);
-				this.state.remaining_tiles = c;
+				// Tiles regenerated since the last one, batched server side
+				this.state.remaining_tiles = Math.min(this.state.remaining_tiles + c, this.state.max_tiles);
 				return;
 			}
 			case bin.RES_LEVEL_UP:
@@ -479,7 +667,7 @@ class PixelClient {
 				// actions.setLevel(data.level)
 				// actions.setUserRequiredExp(data.tilesToNextLevel)
 				// actions.setUserExp(data.levelProgress)
-				this.ws.send(struct('B37s').pack(req.GET_COLORS, this.state.user_id));
+				this.ws.send(struct('B').pack(req.GET_COLORS | req.SESSION));
 				break;
 
 			case "userCount":
@@ -504,7 +692,7 @@ class PixelClient {
 
 			case "error":
 				if (data.msg === "Invalid userID") {
-					this.ws.send(JSON.stringify({ "requestType": "initialAuth" }));
+					this.ws.send(JSON.stringify({ "requestType": "initialAuth", "codecs": canvas_codecs }));
 				}
 				console.log(JSON.stringify(data));
 				// actions.setMessageBoxText(data.msg);
@@ -512,7 +700,7 @@ class PixelClient {
 				break;
 
 			case "reAuthSuccessful":
-				this.ws.send(struct('B37s').pack(req.GET_COLORS, this.state.user_id));
+				this.ws.send(struct('B').pack(req.GET_COLORS | req.SESSION));
 				this.state.max_tiles = data.maxTiles;
 				this.state.remaining_tiles = data.remainingTiles;
 				this.state.admin_perms.ban = data.showBanBtn || false;
@@ -546,7 +734,7 @@ class PixelClient {
 	}
 
 	send_tile(x, y, c) {
-		this.ws.send(struct('B37sHHH').pack(req.POST_TILE, this.state.user_id, x, y, c));
+		this.ws.send(struct('BxHHH').pack(req.POST_TILE | req.SESSION, x, y, c));
 	}
 }
 